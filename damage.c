@@ -0,0 +1,156 @@
+#include "gifpaper.h"
+
+/**
+ * Damage mode. Like streaming mode, the gif is decoded while it plays, but
+ * every frame is drawn into the one pixmap that stays the wallpaper. Most gif
+ * frames only change a small part of the picture, so only the part of the
+ * screen that depends on it is scaled, uploaded and cleared to the root window
+ * again. The cost of a frame follows the size of the change rather than the
+ * size of the screen, and the server holds a single screen-sized pixmap.
+ */
+
+/**
+ * Finds the bounding box of the canvas area that changed when the current
+ * frame was read: the frame's own rectangle, plus that of the frame shown
+ * before it if that one was disposed of. Returns 0 if it lies outside the
+ * (x, y, w, h) part of the gif on display, else stores it relative to that
+ * part.
+ */
+
+static int changed_rect(gd_GIF *gif, gd_Frame *prev, int x, int y, int w,
+                        int h, int *cx, int *cy, int *cw, int *ch)
+{
+    int x0 = gif->fx, y0 = gif->fy;
+    int x1 = gif->fx + gif->fw, y1 = gif->fy + gif->fh;
+
+    if (prev->gce.disposal == 2 || prev->gce.disposal == 3) {
+        x0 = MIN(x0, prev->fx);
+        y0 = MIN(y0, prev->fy);
+        x1 = MAX(x1, prev->fx + prev->fw);
+        y1 = MAX(y1, prev->fy + prev->fh);
+    }
+
+    x0 = MAX(x0, x);
+    y0 = MAX(y0, y);
+    x1 = MIN(x1, x + w);
+    y1 = MIN(y1, y + h);
+    if (x0 >= x1 || y0 >= y1)
+        return 0;
+
+    *cx = x0 - x;
+    *cy = y0 - y;
+    *cw = x1 - x0;
+    *ch = y1 - y0;
+
+    return 1;
+}
+
+/**
+ * Uploads the r part of a screen-sized buffer to the same place in the
+ * pixmap, and redraws it on the root window. The part is gathered in part,
+ * which is screen-sized too.
+ */
+
+static void update_rect(Pixmap pmap, uint8_t *screen, uint8_t *part,
+                        XRectangle *r)
+{
+    for (int row = 0; row < r->height; row++)
+        memcpy(&part[row * r->width * 4],
+               &screen[((r->y + row) * scr->width + r->x) * 4], r->width * 4);
+    _generate_pmap(pmap, part, r->x, r->y, r->width, r->height);
+
+    XClearArea(disp, root, r->x, r->y, r->width, r->height, False);
+}
+
+int display_as_damage(char *gifpath, long framerate)
+{
+    gd_GIF *gif = open_gif(gifpath);
+    if (!gif) {
+        printf("Error: the gif was not readable.\n");
+        return -1;
+    }
+    if (decode_threads > 1)
+        gd_start_decoders(gif, decode_threads);
+
+    int x = 0, y = 0, w = gif->width, h = gif->height;
+    if (crop_mode) {
+        x = crop_params[0];
+        y = crop_params[1];
+        w = crop_params[2];
+        h = crop_params[3];
+    }
+
+    // The gif and the screens as they are on display.
+    uint8_t *frame = (uint8_t *)malloc(w * h * 4);
+    uint8_t *screen = (uint8_t *)malloc(scr->width * scr->height * 4);
+    uint8_t *part = (uint8_t *)malloc(scr->width * scr->height * 4);
+    Pixmap pmap = new_pixmap(scr->width, scr->height);
+#ifdef HAVE_LIBXINERAMA
+    XRectangle *rects = (XRectangle *)malloc(
+        MAX(num_xinerama_screens, 1) * sizeof(XRectangle));
+#else
+    XRectangle *rects = (XRectangle *)malloc(sizeof(XRectangle));
+#endif /* HAVE_LIBXINERAMA */
+
+    // Decoding happens between frames, so they are timed by the wall clock.
+    struct timespec start, end, diff;
+    struct timespec w_frame, w_actual;
+    w_frame.tv_sec = 0;
+    w_frame.tv_nsec = 999999999 / framerate; // 1 second divided by frame rate
+
+    gd_Frame prev;
+    int shown = 0;
+    int loop_frames = 0;
+    while (True) {
+        check_power_conditions();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        prev.gce = gif->gce;
+        prev.fx = gif->fx;
+        prev.fy = gif->fy;
+        prev.fw = gif->fw;
+        prev.fh = gif->fh;
+        if (gd_get_frame(gif) <= 0) {
+            // Start over at the trailer, unless the gif has nothing to show.
+            if (!loop_frames) {
+                printf("Error: the gif has no readable frames.\n");
+                return -1;
+            }
+            gd_rewind(gif);
+            loop_frames = 0;
+            continue;
+        }
+        loop_frames++;
+
+        // If someone else set the wallpaper, set the pixmap again.
+        if (shown && check_root_owner())
+            draw_pmap_to_background(pmap);
+
+        int cx, cy, cw, ch;
+        if (!shown) {
+            render_frame(gif, frame, w * 4, x, y, w, h);
+            fill_screen(screen, frame, w, h);
+            _generate_pmap(pmap, screen, 0, 0, scr->width, scr->height);
+            draw_pmap_to_background(pmap);
+            shown = 1;
+        } else if (changed_rect(gif, &prev, x, y, w, h, &cx, &cy, &cw, &ch)) {
+            render_frame(gif, &frame[(cy * w + cx) * 4], w * 4, x + cx, y + cy,
+                         cw, ch);
+            int n = fill_screen_changed(screen, frame, w, h, cx, cy, cw, ch,
+                                        rects);
+            for (int i = 0; i < n; i++)
+                update_rect(pmap, screen, part, &rects[i]);
+            XFlush(disp);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        diff = time_diff(start, end);
+        if (diff.tv_sec > 0 || diff.tv_nsec >= w_frame.tv_nsec) {
+            printf("Timing failure! Expect a choppy frame...\n");
+        } else {
+            w_actual.tv_sec = 0;
+            w_actual.tv_nsec = w_frame.tv_nsec - diff.tv_nsec;
+            nanosleep(&w_actual, NULL);
+        }
+    }
+}
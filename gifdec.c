@@ -4,63 +4,151 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 
-typedef struct Entry {
-    uint16_t length;
-    uint16_t prefix;
-    uint8_t suffix;
-} Entry;
+/* Largest LZW code and size of the code table. */
+#define MAX_CODES 0x1000
 
 typedef struct Table {
-    int bulk;
-    int nentries;
-    Entry *entries;
+    uint16_t prefix[MAX_CODES];
+    uint16_t length[MAX_CODES];
+    uint8_t suffix[MAX_CODES];
+    uint8_t first[MAX_CODES];
 } Table;
 
-static uint16_t read_num(int fd)
+/* Size of the first chunk read from inputs that cannot be mapped. */
+#define READ_CHUNK (1 << 16)
+
+static size_t read_bytes(gd_GIF *gif, void *dst, size_t n)
+{
+    size_t avail = gif->size - gif->pos;
+
+    if (n > avail) {
+        /* Truncated input: zero-fill what is missing. */
+        memset((uint8_t *)dst + avail, 0, n - avail);
+        n = avail;
+    }
+    memcpy(dst, &gif->data[gif->pos], n);
+    gif->pos += n;
+    return n;
+}
+
+static uint8_t read_byte(gd_GIF *gif)
+{
+    return gif->pos < gif->size ? gif->data[gif->pos++] : 0;
+}
+
+static void skip_bytes(gd_GIF *gif, size_t n)
+{
+    gif->pos += MIN(n, gif->size - gif->pos);
+}
+
+static uint16_t read_num(gd_GIF *gif)
 {
     uint8_t bytes[2];
 
-    read(fd, bytes, 2);
+    read_bytes(gif, bytes, 2);
     return bytes[0] + (((uint16_t)bytes[1]) << 8);
 }
 
-gd_GIF *gd_open_gif(const char *fname)
+/* Map the whole file in memory, or read it into a buffer if it cannot be
+ * mapped (pipes, character devices, ...). Return 0 on success or -1. */
+static int load_input(gd_GIF *gif, int fd)
+{
+    struct stat st;
+    uint8_t *buf, *tmp;
+    size_t cap, len;
+    ssize_t n;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        gif->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (gif->map != MAP_FAILED) {
+            madvise(gif->map, st.st_size, MADV_SEQUENTIAL);
+            gif->data = gif->map;
+            gif->size = st.st_size;
+            return 0;
+        }
+    }
+    gif->map = NULL;
+    cap = READ_CHUNK;
+    len = 0;
+    buf = malloc(cap);
+    if (!buf)
+        return -1;
+    while ((n = read(fd, &buf[len], cap - len)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return -1;
+        }
+        len += n;
+        if (len == cap) {
+            cap *= 2;
+            tmp = realloc(buf, cap);
+            if (!tmp) {
+                free(buf);
+                return -1;
+            }
+            buf = tmp;
+        }
+    }
+    gif->data = buf;
+    gif->size = len;
+    return 0;
+}
+
+static void unload_input(gd_GIF *gif)
+{
+    if (gif->borrowed)
+        return;
+    if (gif->map)
+        munmap(gif->map, gif->size);
+    else
+        free((void *)gif->data);
+}
+
+/* Parse the header of the input loaded in in and create the gd_GIF.
+ * The input is released on failure. */
+static gd_GIF *open_input(gd_GIF *in)
 {
-    int fd;
     uint8_t sigver[3];
     uint16_t width, height, depth;
-    uint8_t fdsz, bgidx, aspect;
+    uint8_t fdsz, bgidx;
     int gct_sz;
     gd_GIF *gif;
 
-    fd = open(fname, O_RDONLY);
-    if (fd == -1)
-        return NULL;
     /* Header */
-    read(fd, sigver, 3);
+    read_bytes(in, sigver, 3);
     if (memcmp(sigver, "GIF", 3) != 0) {
         fprintf(stderr, "invalid signature\n");
         goto fail;
     }
     /* Version */
-    read(fd, sigver, 3);
+    read_bytes(in, sigver, 3);
     if (memcmp(sigver, "89a", 3) != 0) {
         fprintf(stderr, "invalid version\n");
         goto fail;
     }
     /* Width x Height */
-    width = read_num(fd);
-    height = read_num(fd);
+    width = read_num(in);
+    height = read_num(in);
     /* FDSZ */
-    read(fd, &fdsz, 1);
+    fdsz = read_byte(in);
     /* Presence of GCT */
     if (!(fdsz & 0x80)) {
         fprintf(stderr, "no global color table\n");
@@ -72,41 +160,82 @@ gd_GIF *gd_open_gif(const char *fname)
     /* GCT Size */
     gct_sz = 1 << ((fdsz & 0x07) + 1);
     /* Background Color Index */
-    read(fd, &bgidx, 1);
+    bgidx = read_byte(in);
     /* Aspect Ratio */
-    read(fd, &aspect, 1);
+    skip_bytes(in, 1);
     /* Create gd_GIF Structure. */
-    gif = calloc(1, sizeof(*gif) + 4 * width * height);
+    gif = calloc(1, sizeof(*gif) + 5 * width * height);
     if (!gif)
         goto fail;
-    gif->fd = fd;
+    gif->data = in->data;
+    gif->size = in->size;
+    gif->pos = in->pos;
+    gif->map = in->map;
+    gif->borrowed = in->borrowed;
     gif->width = width;
     gif->height = height;
     gif->depth = depth;
     /* Read GCT */
     gif->gct.size = gct_sz;
-    read(fd, gif->gct.colors, 3 * gif->gct.size);
+    read_bytes(gif, gif->gct.colors, 3 * gif->gct.size);
     gif->palette = &gif->gct;
     gif->bgindex = bgidx;
     gif->canvas = (uint8_t *)&gif[1];
     gif->frame = &gif->canvas[3 * width * height];
+    gif->lines = &gif->frame[width * height];
     if (gif->bgindex)
         memset(gif->frame, gif->bgindex, gif->width * gif->height);
-    gif->anim_start = lseek(fd, 0, SEEK_CUR);
-    goto ok;
+    gif->anim_start = gif->pos;
+    return gif;
 fail:
+    unload_input(in);
+    return NULL;
+}
+
+gd_GIF *gd_open_gif(const char *fname)
+{
+    int fd;
+    gd_GIF *gif;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    gif = gd_open_gif_fd(fd);
     close(fd);
-ok:
     return gif;
 }
 
+/* Open a GIF from an open file descriptor, which is left open. Regular files
+ * are mapped from their start; anything else (pipes, sockets, terminals) is
+ * read from the current position to the end, so it need not be seekable. */
+gd_GIF *gd_open_gif_fd(int fd)
+{
+    gd_GIF in = {0};
+
+    if (load_input(&in, fd) == -1)
+        return NULL;
+    return open_input(&in);
+}
+
+/* Open a GIF from size bytes at data, without copying them. The memory must
+ * stay valid and unchanged until gd_close_gif(). */
+gd_GIF *gd_open_gif_memory(const void *data, size_t size)
+{
+    gd_GIF in = {0};
+
+    in.data = data;
+    in.size = size;
+    in.borrowed = 1;
+    return open_input(&in);
+}
+
 static void discard_sub_blocks(gd_GIF *gif)
 {
     uint8_t size;
 
     do {
-        read(gif->fd, &size, 1);
-        lseek(gif->fd, size, SEEK_CUR);
+        size = read_byte(gif);
+        skip_bytes(gif, size);
     } while (size);
 }
 
@@ -115,22 +244,22 @@ static void read_plain_text_ext(gd_GIF *gif)
     if (gif->plain_text) {
         uint16_t tx, ty, tw, th;
         uint8_t cw, ch, fg, bg;
-        off_t sub_block;
-        lseek(gif->fd, 1, SEEK_CUR); /* block size = 12 */
-        tx = read_num(gif->fd);
-        ty = read_num(gif->fd);
-        tw = read_num(gif->fd);
-        th = read_num(gif->fd);
-        read(gif->fd, &cw, 1);
-        read(gif->fd, &ch, 1);
-        read(gif->fd, &fg, 1);
-        read(gif->fd, &bg, 1);
-        sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        size_t sub_block;
+        skip_bytes(gif, 1); /* block size = 12 */
+        tx = read_num(gif);
+        ty = read_num(gif);
+        tw = read_num(gif);
+        th = read_num(gif);
+        cw = read_byte(gif);
+        ch = read_byte(gif);
+        fg = read_byte(gif);
+        bg = read_byte(gif);
+        sub_block = gif->pos;
         gif->plain_text(gif, tx, ty, tw, th, cw, ch, fg, bg);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gif->pos = sub_block;
     } else {
         /* Discard plain text metadata. */
-        lseek(gif->fd, 13, SEEK_CUR);
+        skip_bytes(gif, 13);
     }
     /* Discard plain text sub-blocks. */
     discard_sub_blocks(gif);
@@ -141,23 +270,23 @@ static void read_graphic_control_ext(gd_GIF *gif)
     uint8_t rdit;
 
     /* Discard block size (always 0x04). */
-    lseek(gif->fd, 1, SEEK_CUR);
-    read(gif->fd, &rdit, 1);
+    skip_bytes(gif, 1);
+    rdit = read_byte(gif);
     gif->gce.disposal = (rdit >> 2) & 3;
     gif->gce.input = rdit & 2;
     gif->gce.transparency = rdit & 1;
-    gif->gce.delay = read_num(gif->fd);
-    read(gif->fd, &gif->gce.tindex, 1);
+    gif->gce.delay = read_num(gif);
+    gif->gce.tindex = read_byte(gif);
     /* Skip block terminator. */
-    lseek(gif->fd, 1, SEEK_CUR);
+    skip_bytes(gif, 1);
 }
 
 static void read_comment_ext(gd_GIF *gif)
 {
     if (gif->comment) {
-        off_t sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        size_t sub_block = gif->pos;
         gif->comment(gif);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gif->pos = sub_block;
     }
     /* Discard comment sub-blocks. */
     discard_sub_blocks(gif);
@@ -169,21 +298,21 @@ static void read_application_ext(gd_GIF *gif)
     char app_auth_code[3];
 
     /* Discard block size (always 0x0B). */
-    lseek(gif->fd, 1, SEEK_CUR);
+    skip_bytes(gif, 1);
     /* Application Identifier. */
-    read(gif->fd, app_id, 8);
+    read_bytes(gif, app_id, 8);
     /* Application Authentication Code. */
-    read(gif->fd, app_auth_code, 3);
+    read_bytes(gif, app_auth_code, 3);
     if (!strncmp(app_id, "NETSCAPE", sizeof(app_id))) {
         /* Discard block size (0x03) and constant byte (0x01). */
-        lseek(gif->fd, 2, SEEK_CUR);
-        gif->loop_count = read_num(gif->fd);
+        skip_bytes(gif, 2);
+        gif->loop_count = read_num(gif);
         /* Skip block terminator. */
-        lseek(gif->fd, 1, SEEK_CUR);
+        skip_bytes(gif, 1);
     } else if (gif->application) {
-        off_t sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        size_t sub_block = gif->pos;
         gif->application(gif, app_id, app_auth_code);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gif->pos = sub_block;
         discard_sub_blocks(gif);
     } else {
         discard_sub_blocks(gif);
@@ -194,7 +323,7 @@ static void read_ext(gd_GIF *gif)
 {
     uint8_t label;
 
-    read(gif->fd, &label, 1);
+    label = read_byte(gif);
     switch (label) {
     case 0x01:
         read_plain_text_ext(gif);
@@ -213,165 +342,298 @@ static void read_ext(gd_GIF *gif)
     }
 }
 
-static Table *new_table(int key_size)
+/* Decompress the LZW stream of an image whose minimum code size byte is at
+ * data[pos], writing up to npix color indices to out in stream order.
+ * Codes are taken from a 64-bit bit accumulator refilled straight from the
+ * sub-blocks, and every string is emitted in a single backwards pass over the
+ * code table. *end is set past the block terminator.
+ * Return the number of pixels decoded, or -1 on out-of-memory. */
+static int lzw_decode(const uint8_t *data, size_t size, size_t pos,
+                      uint8_t *out, int npix, size_t *end)
 {
-    int key;
-    int init_bulk = MAX(1 << (key_size + 1), 0x100);
-    Table *table = malloc(sizeof(*table) + sizeof(Entry) * init_bulk);
-    if (table) {
-        table->bulk = init_bulk;
-        table->nentries = (1 << key_size) + 2;
-        table->entries = (Entry *)&table[1];
-        for (key = 0; key < (1 << key_size); key++)
-            table->entries[key] = (Entry){1, 0xFFF, key};
+    Table *table;
+    uint64_t acc;
+    int nbits, blk_left;
+    int min_key_size, key_size, nentries;
+    int clear, stop, key, prev, len, skip, n, i;
+
+    table = malloc(sizeof(*table));
+    if (!table) {
+        *end = size;
+        return -1;
+    }
+    min_key_size = pos < size ? MIN(data[pos], 11) : 0;
+    pos++;
+    clear = 1 << min_key_size;
+    stop = clear + 1;
+    for (key = 0; key < clear; key++) {
+        table->prefix[key] = 0xFFF;
+        table->length[key] = 1;
+        table->suffix[key] = key;
+        table->first[key] = key;
     }
-    return table;
+    key_size = min_key_size + 1;
+    nentries = clear + 2;
+    prev = -1;
+    acc = 0;
+    nbits = 0;
+    blk_left = 0;
+    n = 0;
+    while (n < npix) {
+        /* Refill the accumulator, whole words while the sub-block allows. */
+        while (nbits < key_size) {
+            if (!blk_left) {
+                if (pos >= size || !data[pos])
+                    goto done;
+                blk_left = MIN(data[pos], size - pos - 1);
+                pos++;
+                if (!blk_left)
+                    goto done;
+            }
+            if (blk_left >= 8) {
+                uint64_t word;
+                int take = MIN((64 - nbits) >> 3, 8);
+                memcpy(&word, &data[pos], 8);
+                word = le64toh(word);
+                if (take < 8)
+                    word &= ((uint64_t)1 << (take * 8)) - 1;
+                acc |= word << nbits;
+                nbits += take * 8;
+                pos += take;
+                blk_left -= take;
+            } else {
+                acc |= (uint64_t)data[pos++] << nbits;
+                nbits += 8;
+                blk_left--;
+            }
+        }
+        key = acc & ((1 << key_size) - 1);
+        acc >>= key_size;
+        nbits -= key_size;
+
+        if (key == clear) {
+            key_size = min_key_size + 1;
+            nentries = clear + 2;
+            prev = -1;
+            continue;
+        }
+        if (key == stop)
+            break;
+        if (prev == -1) {
+            if (key >= clear)
+                break;
+            out[n++] = table->suffix[key];
+            prev = key;
+            continue;
+        }
+        if (key > nentries || (key == nentries && nentries == MAX_CODES))
+            break; /* Corrupt stream. */
+        if (nentries < MAX_CODES) {
+            /* The new string is prev plus the first byte of key's string,
+             * which for key == nentries (KwKwK) is prev's own first byte. */
+            table->prefix[nentries] = prev;
+            table->length[nentries] = table->length[prev] + 1;
+            table->first[nentries] = table->first[prev];
+            table->suffix[nentries] =
+                key == nentries ? table->first[prev] : table->first[key];
+            nentries++;
+            if (nentries == (1 << key_size) && key_size < 12)
+                key_size++;
+        }
+        /* Emit the string backwards, dropping what overflows the frame. */
+        len = table->length[key];
+        skip = MAX(n + len - npix, 0);
+        prev = key;
+        for (i = 0; i < skip; i++)
+            key = table->prefix[key];
+        for (i = n + len - skip - 1; i >= n; i--) {
+            out[i] = table->suffix[key];
+            key = table->prefix[key];
+        }
+        n += len - skip;
+    }
+done:
+    free(table);
+    /* Skip whatever remains of the data sub-blocks. */
+    pos += blk_left;
+    while (pos < size && data[pos])
+        pos += data[pos] + 1;
+    *end = MIN(pos + 1, size);
+    return n;
 }
 
-/* Add table entry. Return value:
- *  0 on success
- *  +1 if key size must be incremented after this addition
- *  -1 if could not realloc table */
-static int add_entry(Table **tablep, uint16_t length, uint16_t prefix,
-                     uint8_t suffix)
+/* Copy the h decoded lines of the current frame into gif->frame, mapping
+ * each line to its output row once, including the four interlace passes.
+ * Rows and columns outside the (clipped) frame rectangle are dropped. */
+static void place_lines(gd_GIF *gif, const uint8_t *lines, int n, int stride,
+                        int h, int interlace)
 {
-    Table *table = *tablep;
-    if (table->nentries == table->bulk) {
-        table->bulk *= 2;
-        table = realloc(table, sizeof(*table) + sizeof(Entry) * table->bulk);
-        if (!table)
-            return -1;
-        table->entries = (Entry *)&table[1];
-        *tablep = table;
+    static const int start[] = {0, 4, 2, 1};
+    static const int step[] = {8, 8, 4, 2};
+    int pass, y, dy;
+
+    for (pass = interlace ? 0 : 3; pass < 4 && n > 0; pass++) {
+        y = interlace ? start[pass] : 0;
+        dy = interlace ? step[pass] : 1;
+        for (; y < h && n > 0; y += dy, n -= stride, lines += stride) {
+            if (y < gif->fh)
+                memcpy(&gif->frame[(gif->fy + y) * gif->width + gif->fx],
+                       lines, MIN(n, gif->fw));
+        }
     }
-    table->entries[table->nentries] = (Entry){length, prefix, suffix};
-    table->nentries++;
-    if ((table->nentries & (table->nentries - 1)) == 0)
-        return 1;
-    return 0;
 }
 
-static uint16_t get_key(gd_GIF *gif, int key_size, uint8_t *sub_len,
-                        uint8_t *shift, uint8_t *byte)
+/* Parallel decoding.
+ * Worker threads decompress the LZW streams of upcoming frames, located
+ * through the frame index, into a ring of slots; read_image_data() then only
+ * has to place the lines of the frame it reaches. Slot k holds frames
+ * k, k + nslots, k + 2 * nslots, ... so frames are handed out in order. */
+
+enum { SLOT_EMPTY, SLOT_BUSY, SLOT_READY };
+
+typedef struct Slot {
+    int state;
+    int seq, gen;
+    int n;
+    size_t end;
+    uint8_t *lines;
+} Slot;
+
+typedef struct gd_Decoder {
+    const uint8_t *data;
+    size_t size;
+    /* Start of each frame's LZW data and its declared pixel count. */
+    size_t *start;
+    int *npix;
+    int nframes;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Next frame to decode, next frame to be read, reset generation. */
+    int next, cur, gen;
+    int stop;
+    Slot *slots;
+    int nslots;
+    pthread_t *threads;
+    int nthreads;
+} gd_Decoder;
+
+static void *decoder_thread(void *arg)
 {
-    int bits_read;
-    int rpad;
-    int frag_size;
-    uint16_t key;
+    gd_Decoder *d = arg;
+    Slot *slot;
+    size_t end;
+    int seq, n;
 
-    key = 0;
-    for (bits_read = 0; bits_read < key_size; bits_read += frag_size) {
-        rpad = (*shift + bits_read) % 8;
-        if (rpad == 0) {
-            /* Update byte. */
-            if (*sub_len == 0)
-                read(gif->fd, sub_len, 1); /* Must be nonzero! */
-            read(gif->fd, byte, 1);
-            (*sub_len)--;
+    pthread_mutex_lock(&d->lock);
+    while (!d->stop) {
+        seq = d->next;
+        slot = &d->slots[seq % d->nslots];
+        if (seq >= d->nframes || slot->state != SLOT_EMPTY) {
+            pthread_cond_wait(&d->cond, &d->lock);
+            continue;
+        }
+        slot->state = SLOT_BUSY;
+        slot->seq = seq;
+        slot->gen = d->gen;
+        d->next++;
+        pthread_mutex_unlock(&d->lock);
+        n = lzw_decode(d->data, d->size, d->start[seq], slot->lines,
+                       d->npix[seq], &end);
+        pthread_mutex_lock(&d->lock);
+        if (slot->gen == d->gen) {
+            slot->n = n;
+            slot->end = end;
+            slot->state = SLOT_READY;
+        } else {
+            /* The reader moved elsewhere in the meantime. */
+            slot->state = SLOT_EMPTY;
         }
-        frag_size = MIN(key_size - bits_read, 8 - rpad);
-        key |= ((uint16_t)((*byte) >> rpad)) << bits_read;
+        pthread_cond_broadcast(&d->cond);
     }
-    /* Clear extra bits to the left. */
-    key &= (1 << key_size) - 1;
-    *shift = (*shift + key_size) % 8;
-    return key;
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
 }
 
-/* Compute output index of y-th input line, in frame of height h. */
-static int interlaced_line_index(int h, int y)
+/* Wait for the decoded lines of the frame whose LZW data starts at pos.
+ * If that is not the frame the workers are heading for (after a rewind or a
+ * seek), they are restarted from it.
+ * Return the slot, or NULL if pos is not the start of an indexed frame. */
+static Slot *take_decoded(gd_Decoder *d, size_t pos)
 {
-    int p; /* number of lines in current pass */
+    Slot *slot;
+    int lo, hi, mid, i;
 
-    p = (h - 1) / 8 + 1;
-    if (y < p) /* pass 1 */
-        return y * 8;
-    y -= p;
-    p = (h - 5) / 8 + 1;
-    if (y < p) /* pass 2 */
-        return y * 8 + 4;
-    y -= p;
-    p = (h - 3) / 4 + 1;
-    if (y < p) /* pass 3 */
-        return y * 4 + 2;
-    y -= p;
-    /* pass 4 */
-    return y * 2 + 1;
+    pthread_mutex_lock(&d->lock);
+    if (d->cur >= d->nframes || d->start[d->cur] != pos) {
+        for (lo = 0, hi = d->nframes; lo < hi;) {
+            mid = (lo + hi) / 2;
+            if (d->start[mid] < pos)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == d->nframes || d->start[lo] != pos) {
+            pthread_mutex_unlock(&d->lock);
+            return NULL;
+        }
+        for (i = 0; i < d->nslots; i++)
+            if (d->slots[i].state == SLOT_READY)
+                d->slots[i].state = SLOT_EMPTY;
+        d->gen++;
+        d->next = d->cur = lo;
+        pthread_cond_broadcast(&d->cond);
+    }
+    slot = &d->slots[d->cur % d->nslots];
+    while (slot->state != SLOT_READY || slot->seq != d->cur ||
+           slot->gen != d->gen)
+        pthread_cond_wait(&d->cond, &d->lock);
+    pthread_mutex_unlock(&d->lock);
+    return slot;
+}
+
+static void release_decoded(gd_Decoder *d, Slot *slot)
+{
+    pthread_mutex_lock(&d->lock);
+    slot->state = SLOT_EMPTY;
+    d->cur++;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
 }
 
 /* Decompress image pixels.
  * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table). */
 static int read_image_data(gd_GIF *gif, int interlace)
 {
-    uint8_t sub_len, shift, byte;
-    int init_key_size, key_size, table_is_full;
-    int frm_off, str_len, p, x, y;
-    uint16_t key, clear, stop;
-    int ret;
-    Table *table;
-    Entry entry;
-    off_t start, end;
+    uint8_t *lines;
+    int stride, h, npix, n;
+    size_t end;
+    Slot *slot = NULL;
 
-    read(gif->fd, &byte, 1);
-    key_size = (int)byte;
-    start = lseek(gif->fd, 0, SEEK_CUR);
-    discard_sub_blocks(gif);
-    end = lseek(gif->fd, 0, SEEK_CUR);
-    lseek(gif->fd, start, SEEK_SET);
-    clear = 1 << key_size;
-    stop = clear + 1;
-    table = new_table(key_size);
-    key_size++;
-    init_key_size = key_size;
-    sub_len = shift = 0;
-    key = get_key(gif, key_size, &sub_len, &shift, &byte); /* clear code */
-    frm_off = 0;
-    ret = 0;
-    while (1) {
-        if (key == clear) {
-            key_size = init_key_size;
-            table->nentries = (1 << (key_size - 1)) + 2;
-            table_is_full = 0;
-        } else if (!table_is_full) {
-            ret = add_entry(&table, str_len + 1, key, entry.suffix);
-            if (ret == -1) {
-                free(table);
-                return -1;
-            }
-            if (table->nentries == 0x1000) {
-                ret = 0;
-                table_is_full = 1;
-            }
-        }
-        key = get_key(gif, key_size, &sub_len, &shift, &byte);
-        if (key == clear)
-            continue;
-        if (key == stop)
-            break;
-        if (ret == 1)
-            key_size++;
-        entry = table->entries[key];
-        str_len = entry.length;
-        while (1) {
-            p = frm_off + entry.length - 1;
-            x = p % gif->fw;
-            y = p / gif->fw;
-            if (interlace)
-                y = interlaced_line_index((int)gif->fh, y);
-            gif->frame[(gif->fy + y) * gif->width + gif->fx + x] = entry.suffix;
-            if (entry.prefix == 0xFFF)
-                break;
-            else
-                entry = table->entries[entry.prefix];
-        }
-        frm_off += str_len;
-        if (key < table->nentries - 1 && !table_is_full)
-            table->entries[table->nentries - 1].suffix = entry.suffix;
+    /* Lines are decoded at the declared frame width, then clipped. */
+    stride = gif->fw;
+    h = gif->fh;
+    npix = stride * h;
+    if (gif->decoder && (slot = take_decoded(gif->decoder, gif->pos))) {
+        lines = slot->lines;
+        n = slot->n;
+        end = slot->end;
+    } else {
+        if (npix <= gif->width * gif->height)
+            lines = gif->lines;
+        else if (!(lines = malloc(npix)))
+            return -1;
+        n = lzw_decode(gif->data, gif->size, gif->pos, lines, npix, &end);
     }
-    free(table);
-    read(gif->fd, &sub_len, 1); /* Must be zero! */
-    lseek(gif->fd, end, SEEK_SET);
-    return 0;
+    gif->pos = end;
+    gif->fw = MIN(gif->fx < gif->width ? gif->width - gif->fx : 0, gif->fw);
+    gif->fh = MIN(gif->fy < gif->height ? gif->height - gif->fy : 0, gif->fh);
+    if (n > 0 && gif->fw)
+        place_lines(gif, lines, n, stride, h, interlace);
+    if (slot)
+        release_decoded(gif->decoder, slot);
+    else if (lines != gif->lines)
+        free(lines);
+    return n < 0 ? -1 : 0;
 }
 
 /* Read image.
@@ -382,18 +644,21 @@ static int read_image(gd_GIF *gif)
     int interlace;
 
     /* Image Descriptor. */
-    gif->fx = read_num(gif->fd);
-    gif->fy = read_num(gif->fd);
-    gif->fw = read_num(gif->fd);
-    gif->fh = read_num(gif->fd);
-    read(gif->fd, &fisrz, 1);
+    gif->fx = read_num(gif);
+    gif->fy = read_num(gif);
+    gif->fw = read_num(gif);
+    gif->fh = read_num(gif);
+    fisrz = read_byte(gif);
     interlace = fisrz & 0x40;
     /* Ignore Sort Flag. */
     /* Local Color Table? */
     if (fisrz & 0x80) {
         /* Read LCT */
         gif->lct.size = 1 << ((fisrz & 0x07) + 1);
-        read(gif->fd, gif->lct.colors, 3 * gif->lct.size);
+        read_bytes(gif, gif->lct.colors, 3 * gif->lct.size);
+        /* Out-of-range indices must not see a previous frame's colors. */
+        memset(&gif->lct.colors[3 * gif->lct.size], 0,
+               sizeof(gif->lct.colors) - 3 * gif->lct.size);
         gif->palette = &gif->lct;
     } else
         gif->palette = &gif->gct;
@@ -401,33 +666,117 @@ static int read_image(gd_GIF *gif)
     return read_image_data(gif, interlace);
 }
 
+/* Compositing kernels.
+ * Palette entries are widened to 32 bits (R, G, B, 0 in memory) so that a
+ * pixel can be fetched with a single load or gather. tindex is the
+ * transparent color index, or -1 if the frame has none. */
+
+typedef void (*CompositeFn)(uint8_t *dst, const uint8_t *index, int n,
+                            const uint32_t *pal, int tindex);
+
+static void composite_row(uint8_t *dst, const uint8_t *index, int n,
+                          const uint32_t *pal, int tindex)
+{
+    int k;
+
+    for (k = 0; k < n; k++, dst += 3)
+        if (index[k] != tindex)
+            memcpy(dst, &pal[index[k]], 3);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Eight pixels at a time: gather their colors, keep the old ones under
+ * transparent pixels, then pack 8 x 32 bits down to 24 bytes. */
+__attribute__((target("avx2"))) static void
+composite_row_avx2(uint8_t *dst, const uint8_t *index, int n,
+                   const uint32_t *pal, int tindex)
+{
+    const __m256i pack = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i unpack = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i key = _mm256_set1_epi32(tindex);
+    __m256i idx, px, old, transparent;
+    __m128i hi;
+    int32_t tail;
+    int k;
+
+    for (k = 0; k + 8 <= n; k += 8, dst += 24) {
+        idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&index[k]));
+        px = _mm256_i32gather_epi32((const int *)pal, idx, 4);
+        transparent = _mm256_cmpeq_epi32(idx, key);
+        if (!_mm256_testz_si256(transparent, transparent)) {
+            old = _mm256_setr_m128i(_mm_loadu_si128((const __m128i *)dst),
+                                    _mm_loadl_epi64((const __m128i *)&dst[12]));
+            memcpy(&tail, &dst[20], 4);
+            old = _mm256_insert_epi32(old, tail, 6);
+            px = _mm256_blendv_epi8(px, _mm256_shuffle_epi8(old, unpack),
+                                    transparent);
+        }
+        px = _mm256_shuffle_epi8(px, pack);
+        hi = _mm256_extracti128_si256(px, 1);
+        /* The low store spills 4 bytes that the high half overwrites; the
+         * high half is stored in two parts so nothing past dst[23] is hit. */
+        _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(px));
+        _mm_storel_epi64((__m128i *)&dst[12], hi);
+        memcpy(&dst[20], (const uint8_t *)&hi + 8, 4);
+    }
+    composite_row(dst, &index[k], n - k, pal, tindex);
+}
+#endif
+
+static CompositeFn select_composite(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return composite_row_avx2;
+#endif
+    return composite_row;
+}
+
+/* Fill n RGB pixels from a pattern of 16 copies of the same color; whole
+ * 48-byte chunks compile down to vector stores. */
+static void fill_row(uint8_t *dst, int n, const uint8_t pattern[48])
+{
+    for (; n >= 16; n -= 16, dst += 48)
+        memcpy(dst, pattern, 48);
+    memcpy(dst, pattern, 3 * n);
+}
+
 static void render_frame_rect(gd_GIF *gif, uint8_t *buffer)
 {
-    int i, j, k;
-    uint8_t index, *color;
+    static CompositeFn composite;
+    uint32_t pal[0x100];
+    int i, j;
+
+    if (!composite)
+        composite = select_composite();
+    for (i = 0; i < 0x100; i++) {
+        pal[i] = 0;
+        memcpy(&pal[i], &gif->palette->colors[i * 3], 3);
+    }
     i = gif->fy * gif->width + gif->fx;
     for (j = 0; j < gif->fh; j++) {
-        for (k = 0; k < gif->fw; k++) {
-            index = gif->frame[(gif->fy + j) * gif->width + gif->fx + k];
-            color = &gif->palette->colors[index * 3];
-            if (!gif->gce.transparency || index != gif->gce.tindex)
-                memcpy(&buffer[(i + k) * 3], color, 3);
-        }
+        composite(&buffer[i * 3], &gif->frame[i], gif->fw, pal,
+                  gif->gce.transparency ? gif->gce.tindex : -1);
         i += gif->width;
     }
 }
 
 static void dispose(gd_GIF *gif)
 {
-    int i, j, k;
-    uint8_t *bgcolor;
+    int i, j;
+    uint8_t pattern[48];
     switch (gif->gce.disposal) {
     case 2: /* Restore to background color. */
-        bgcolor = &gif->palette->colors[gif->bgindex * 3];
+        for (i = 0; i < 16; i++)
+            memcpy(&pattern[i * 3], &gif->palette->colors[gif->bgindex * 3],
+                   3);
         i = gif->fy * gif->width + gif->fx;
         for (j = 0; j < gif->fh; j++) {
-            for (k = 0; k < gif->fw; k++)
-                memcpy(&gif->canvas[(i + k) * 3], bgcolor, 3);
+            fill_row(&gif->canvas[i * 3], gif->fw, pattern);
             i += gif->width;
         }
         break;
@@ -445,7 +794,7 @@ int gd_get_frame(gd_GIF *gif)
     char sep;
 
     dispose(gif);
-    read(gif->fd, &sep, 1);
+    sep = read_byte(gif);
     while (sep != ',') {
         if (sep == ';')
             return 0;
@@ -453,7 +802,7 @@ int gd_get_frame(gd_GIF *gif)
             read_ext(gif);
         else
             return -1;
-        read(gif->fd, &sep, 1);
+        sep = read_byte(gif);
     }
     if (read_image(gif) == -1)
         return -1;
@@ -466,13 +815,261 @@ void gd_render_frame(gd_GIF *gif, uint8_t *buffer)
     render_frame_rect(gif, buffer);
 }
 
+/* Fill lut[c][v] with channel value v of channel c (R, G, B) moved into place
+ * under mask[c], keeping the most significant bits when a channel has fewer
+ * than eight of them. */
+static void build_channel_luts(uint32_t lut[3][0x100], const uint32_t mask[3])
+{
+    int c, v, shift, bits;
+
+    for (c = 0; c < 3; c++) {
+        shift = mask[c] ? __builtin_ctz(mask[c]) : 0;
+        bits = __builtin_popcount(mask[c]);
+        for (v = 0; v < 0x100; v++) {
+            if (bits >= 8)
+                lut[c][v] = ((uint32_t)v << (shift + bits - 8)) & mask[c];
+            else
+                lut[c][v] = ((uint32_t)v >> (8 - bits) << shift) & mask[c];
+        }
+    }
+}
+
+static void canvas_span_32(const uint32_t lut[3][0x100], const uint8_t *src,
+                           uint32_t *dst, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++, src += 3)
+        dst[i] = lut[0][src[0]] | lut[1][src[1]] | lut[2][src[2]];
+}
+
+/* Render the (x, y, w, h) part of the current frame, i.e. the canvas with the
+ * frame composited on top, as 32-bit pixels laid out by the given channel
+ * masks (e.g. those of an X visual). Rows are stride bytes apart in buffer,
+ * which must be 4-byte aligned; the rectangle must lie inside the canvas.
+ * Every output pixel is written exactly once. */
+void gd_render_rect_32(gd_GIF *gif, uint8_t *buffer, size_t stride, int x,
+                       int y, int w, int h, uint32_t rmask, uint32_t gmask,
+                       uint32_t bmask)
+{
+    const uint32_t mask[3] = {rmask, gmask, bmask};
+    uint32_t lut[3][0x100], pal[0x100];
+    const uint8_t *src, *index, *color;
+    uint32_t *dst;
+    int i, j, k, x0, x1;
+
+    build_channel_luts(lut, mask);
+    for (i = 0; i < 0x100; i++) {
+        color = &gif->palette->colors[i * 3];
+        pal[i] = lut[0][color[0]] | lut[1][color[1]] | lut[2][color[2]];
+    }
+    /* Columns of the frame rectangle inside the rendered rectangle. */
+    x0 = MIN(MAX(gif->fx, x), x + w);
+    x1 = MAX(MIN(gif->fx + gif->fw, x + w), x0);
+    for (j = y; j < y + h; j++, buffer += stride) {
+        dst = (uint32_t *)buffer;
+        src = &gif->canvas[3 * (j * gif->width + x)];
+        if (j < gif->fy || j >= gif->fy + gif->fh || x0 == x1) {
+            canvas_span_32(lut, src, dst, w);
+            continue;
+        }
+        canvas_span_32(lut, src, dst, x0 - x);
+        index = &gif->frame[j * gif->width];
+        for (k = x0; k < x1; k++) {
+            if (!gif->gce.transparency || index[k] != gif->gce.tindex)
+                dst[k - x] = pal[index[k]];
+            else
+                canvas_span_32(lut, &src[3 * (k - x)], &dst[k - x], 1);
+        }
+        canvas_span_32(lut, &src[3 * (x1 - x)], &dst[x1 - x], x + w - x1);
+    }
+}
+
 void gd_rewind(gd_GIF *gif)
 {
-    lseek(gif->fd, gif->anim_start, SEEK_SET);
+    gif->pos = gif->anim_start;
+}
+
+/* Scan the whole animation, skipping over the image data sub-blocks, and
+ * record where each frame starts together with its descriptor and GCE.
+ * The read position and GCE are left untouched.
+ * Return the number of frames or -1 on out-of-memory. */
+int gd_index_frames(gd_GIF *gif)
+{
+    size_t pos = gif->pos;
+    gd_GCE gce = gif->gce;
+    gd_Frame *frames = NULL, *tmp, *f;
+    int nframes = 0, bulk = 0;
+    uint8_t sep, fisrz;
+
+    gif->pos = gif->anim_start;
+    memset(&gif->gce, 0, sizeof(gif->gce));
+    while ((sep = read_byte(gif)) != ';') {
+        if (sep == '!') {
+            if (read_byte(gif) == 0xF9)
+                read_graphic_control_ext(gif);
+            else
+                discard_sub_blocks(gif);
+            continue;
+        }
+        if (sep != ',')
+            break;
+        if (nframes == bulk) {
+            bulk = bulk ? bulk * 2 : 64;
+            tmp = realloc(frames, bulk * sizeof(*frames));
+            if (!tmp) {
+                free(frames);
+                nframes = -1;
+                goto done;
+            }
+            frames = tmp;
+        }
+        f = &frames[nframes++];
+        f->offset = gif->pos - 1;
+        f->gce = gif->gce;
+        f->fx = read_num(gif);
+        f->fy = read_num(gif);
+        f->fw = read_num(gif);
+        f->fh = read_num(gif);
+        fisrz = read_byte(gif);
+        f->interlace = fisrz & 0x40;
+        f->lct_size = fisrz & 0x80 ? 1 << ((fisrz & 0x07) + 1) : 0;
+        skip_bytes(gif, 3 * f->lct_size);
+        /* Skip LZW minimum code size, then the data sub-blocks. */
+        skip_bytes(gif, 1);
+        discard_sub_blocks(gif);
+    }
+    free(gif->frames);
+    gif->frames = frames;
+    gif->nframes = nframes;
+done:
+    gif->pos = pos;
+    gif->gce = gce;
+    return nframes;
+}
+
+/* Prepare gif so that the next gd_get_frame() call returns frame n.
+ * If canvas is not NULL it must hold a copy of gif->canvas taken right after
+ * gd_get_frame() returned frame n, and decoding resumes from it directly.
+ * Otherwise frames 0 to n-1 are decoded again from the start.
+ * Return 0 on success or -1 on error. */
+int gd_seek_frame(gd_GIF *gif, int n, const uint8_t *canvas)
+{
+    int i;
+
+    if (!gif->frames && gd_index_frames(gif) == -1)
+        return -1;
+    if (n < 0 || n >= gif->nframes)
+        return -1;
+    /* An empty rectangle leaves nothing for the next dispose() to do. */
+    gif->fw = gif->fh = 0;
+    if (canvas) {
+        memcpy(gif->canvas, canvas, 3 * gif->width * gif->height);
+        gif->gce = gif->frames[n].gce;
+        gif->pos = gif->frames[n].offset;
+        return 0;
+    }
+    memset(gif->canvas, 0, 3 * gif->width * gif->height);
+    memset(&gif->gce, 0, sizeof(gif->gce));
+    gif->pos = gif->anim_start;
+    for (i = 0; i < n; i++)
+        if (gd_get_frame(gif) != 1)
+            return -1;
+    return 0;
+}
+
+static void free_decoder(gd_Decoder *d)
+{
+    int i;
+
+    for (i = 0; i < d->nslots; i++)
+        free(d->slots[i].lines);
+    free(d->slots);
+    free(d->threads);
+    free(d->start);
+    free(d->npix);
+    free(d);
+}
+
+/* Start nthreads workers that decompress frames ahead of gd_get_frame(),
+ * which keeps returning the same frames in the same order. Only the LZW
+ * decompression runs in parallel; compositing stays with the caller.
+ * Return 0 on success or -1 on error, in which case decoding stays serial. */
+int gd_start_decoders(gd_GIF *gif, int nthreads)
+{
+    gd_Decoder *d;
+    size_t max_npix = 0;
+    int i;
+
+    if (gif->decoder || nthreads < 1)
+        return -1;
+    if (!gif->frames && gd_index_frames(gif) == -1)
+        return -1;
+    d = calloc(1, sizeof(*d));
+    if (!d)
+        return -1;
+    d->data = gif->data;
+    d->size = gif->size;
+    d->nframes = gif->nframes;
+    d->start = malloc(d->nframes * sizeof(*d->start));
+    d->npix = malloc(d->nframes * sizeof(*d->npix));
+    /* Two frames in flight per thread keep the workers busy. */
+    d->nslots = 2 * nthreads;
+    d->slots = calloc(d->nslots, sizeof(*d->slots));
+    d->threads = malloc(nthreads * sizeof(*d->threads));
+    if (!d->start || !d->npix || !d->slots || !d->threads)
+        goto fail;
+    for (i = 0; i < d->nframes; i++) {
+        gd_Frame *f = &gif->frames[i];
+        /* Separator, 9-byte descriptor, then the local color table. */
+        d->start[i] = f->offset + 10 + 3 * f->lct_size;
+        d->npix[i] = f->fw * f->fh;
+        max_npix = MAX(max_npix, (size_t)d->npix[i]);
+    }
+    for (i = 0; i < d->nslots; i++)
+        if (!(d->slots[i].lines = malloc(MAX(max_npix, 1))))
+            goto fail;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    for (d->nthreads = 0; d->nthreads < nthreads; d->nthreads++)
+        if (pthread_create(&d->threads[d->nthreads], NULL, decoder_thread,
+                           d))
+            break;
+    gif->decoder = d;
+    if (!d->nthreads) {
+        gd_stop_decoders(gif);
+        return -1;
+    }
+    return 0;
+fail:
+    free_decoder(d);
+    return -1;
+}
+
+/* Stop the workers started by gd_start_decoders(), if any. */
+void gd_stop_decoders(gd_GIF *gif)
+{
+    gd_Decoder *d = gif->decoder;
+    int i;
+
+    if (!d)
+        return;
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    for (i = 0; i < d->nthreads; i++)
+        pthread_join(d->threads[i], NULL);
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+    free_decoder(d);
+    gif->decoder = NULL;
 }
 
 void gd_close_gif(gd_GIF *gif)
 {
-    close(gif->fd);
+    gd_stop_decoders(gif);
+    free(gif->frames);
+    unload_input(gif);
     free(gif);
 }
@@ -1,6 +1,7 @@
 #ifndef GIFDEC_H
 #define GIFDEC_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -17,9 +18,25 @@ typedef struct gd_GCE {
     int transparency;
 } gd_GCE;
 
+/* Index entry describing one frame, gathered without decoding it. */
+typedef struct gd_Frame {
+    size_t offset; /* position of the image separator */
+    gd_GCE gce;    /* graphic control in effect for the frame */
+    uint16_t fx, fy, fw, fh;
+    int lct_size; /* 0 if the frame has no local color table */
+    int interlace;
+} gd_Frame;
+
+struct gd_Decoder;
+
 typedef struct gd_GIF {
-    int fd;
-    off_t anim_start;
+    /* Input cursor over the whole file: mmap'd, read into memory, or the
+     * caller's own memory if borrowed is set. */
+    const uint8_t *data;
+    size_t size, pos;
+    void *map;
+    int borrowed;
+    size_t anim_start;
     uint16_t width, height;
     uint16_t depth;
     uint16_t loop_count;
@@ -35,13 +52,25 @@ typedef struct gd_GIF {
     void (*application)(struct gd_GIF *gif, char id[8], char auth[3]);
     uint16_t fx, fy, fw, fh;
     uint8_t bgindex;
-    uint8_t *canvas, *frame;
+    uint8_t *canvas, *frame, *lines;
+    gd_Frame *frames;
+    int nframes;
+    struct gd_Decoder *decoder;
 } gd_GIF;
 
 gd_GIF *gd_open_gif(const char *fname);
+gd_GIF *gd_open_gif_fd(int fd);
+gd_GIF *gd_open_gif_memory(const void *data, size_t size);
 int gd_get_frame(gd_GIF *gif);
 void gd_render_frame(gd_GIF *gif, uint8_t *buffer);
+void gd_render_rect_32(gd_GIF *gif, uint8_t *buffer, size_t stride, int x,
+                       int y, int w, int h, uint32_t rmask, uint32_t gmask,
+                       uint32_t bmask);
 void gd_rewind(gd_GIF *gif);
+int gd_index_frames(gd_GIF *gif);
+int gd_seek_frame(gd_GIF *gif, int n, const uint8_t *canvas);
+int gd_start_decoders(gd_GIF *gif, int nthreads);
+void gd_stop_decoders(gd_GIF *gif);
 void gd_close_gif(gd_GIF *gif);
 
 #endif /* GIFDEC_H */
@@ -2,36 +2,83 @@
 
 int display_as_gif(char *gifpath, long framerate)
 {
-    Frame *head = load_images_to_list(gifpath);
-    if (head == NULL) {
+    if (damage_mode)
+        return display_as_damage(gifpath, framerate);
+    if (stream_depth)
+        return display_as_stream(gifpath, framerate);
+
+    // Frames are loaded in the background, the animation starts with the
+    // first of them.
+    FrameTable *t = load_images_in_background(gifpath);
+    if (t == NULL) {
         printf("Error: the gif was not readable.\n");
         return -1;
     }
 
+    pthread_mutex_lock(&t->lock);
+    while (!t->count && !t->loaded)
+        pthread_cond_wait(&t->grown, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+    if (!t->count) {
+        printf("Error: the gif was not readable.\n");
+        return -1;
+    }
+
+    // The loader thread adds to the process' CPU time, so frames are timed by
+    // the wall clock here.
     struct timespec start, end, diff;
     struct timespec w_frame, w_actual;
     w_frame.tv_sec = 0;
     w_frame.tv_nsec = 999999999 / framerate; // 1 second divided by frame rate
 
-    while (True) {
+    for (int i = 0, shown = -1;;) {
         check_power_conditions();
-        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-        set_background(head);
-        head = head->next;
+        pthread_mutex_lock(&t->lock);
+#ifdef HAVE_LIBXRANDR
+        // Screen changes wait in the event queue until every frame is loaded,
+        // then the frames are laid out again for the new screens.
+        ScreenLayout old;
+        if (randr_mode && t->loaded && shown >= 0 && screens_changed(&old)) {
+            relayout_frames(t, shown, &old);
+            if (old.screens)
+                XFree(old.screens);
+        }
+#endif /* HAVE_LIBXRANDR */
+        // Repeated frames were merged, so stay on this one for all of them.
+        long long wait = (long long)w_frame.tv_nsec * t->hold[i];
+        if (i != shown) {
+            set_background(t, i);
+            shown = i;
+        } else {
+            // Waiting for the next frame to load, or a single frame gif.
+            wait = w_frame.tv_nsec;
+        }
+        // Until the gif is loaded, stay on the last frame loaded so far.
+        if (t->loaded || i + 1 < t->count)
+            i = NEXT_FRAME(t, i);
+        pthread_mutex_unlock(&t->lock);
 
-        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+        clock_gettime(CLOCK_MONOTONIC, &end);
         diff = time_diff(start, end);
-        if (diff.tv_sec > 0 || diff.tv_nsec >= w_frame.tv_nsec) {
+        wait -= diff.tv_sec * 1000000000LL + diff.tv_nsec;
+#ifdef HAVE_LIBXPRESENT
+        // Make up for the time frames spent waiting for a vertical blank.
+        if (present_mode)
+            wait -= present_take_delay();
+#endif /* HAVE_LIBXPRESENT */
+        if (wait <= 0) {
             printf("Timing failure! Expect a choppy frame...\n");
         } else {
-            w_actual.tv_sec = 0;
-            w_actual.tv_nsec = w_frame.tv_nsec - diff.tv_nsec;
+            w_actual.tv_sec = wait / 1000000000LL;
+            w_actual.tv_nsec = wait % 1000000000LL;
             nanosleep(&w_actual, NULL);
         }
     }
 }
 
+// display_as_stream lives in stream.c
 // display_as_slideshow lives in slideshow.c
 
 static struct option long_options[] = {
@@ -41,11 +88,20 @@ static struct option long_options[] = {
     {"help", no_argument, NULL, 'h'},
     {"power-save", no_argument, NULL, 'p'},
     {"memory-load", required_argument, NULL, 'l'},
+    {"threads", required_argument, NULL, 't'},
+    {"indexed", no_argument, NULL, 'i'},
+    {"stream", required_argument, NULL, 'S'},
+    {"filter", required_argument, NULL, 'F'},
+    {"xrender", no_argument, NULL, 'X'},
+    {"present", no_argument, NULL, 'P'},
+    {"damage", no_argument, NULL, 'D'},
+    {"verbose", no_argument, NULL, 'v'},
     {NULL, 0, NULL, 0}};
 
 const char *help_string =
     "Gifpaper: a tool for drawing gifs to the X root window (i.e., the wallpaper).\n\
 Syntax: gifpaper [options] wallpaper.gif \n\
+Use - as the gif to read it from standard input. \n\
 \n\
 Options: \n\
 -f FRAMERATE              Set the framerate of the gif. \n\
@@ -54,6 +110,14 @@ Options: \n\
     --crop 'x0 y0 x1 y1'  Crop gif to the dimensions speficied by the coordinates. \n\
     --power-save          Only run the gif if the battery is charging. \n\
     --memory-load LOAD    Dictate the ratio (from 0.0 to 1.0) of frames that should be fully cached, versus partially cached. \n\
+    --indexed             Store partially cached frames as palette indices, using a quarter of the memory. \n\
+    --stream DEPTH        Decode the gif while it plays, keeping DEPTH frames ready, so memory use does not grow with its length. \n\
+    --threads THREADS     Decode and scale the gif on this many threads (0 for one per CPU). \n\
+    --filter FILTER       Scale with the nearest, bilinear or lanczos filter (nearest by default). \n\
+    --xrender             Keep frames at the gif's size and let the X server scale them, saving memory. \n\
+    --present             Flip frames on the vertical blank with the Present extension. SIGUSR1 prints the measured jitter. \n\
+    --damage              Decode the gif while it plays into a single pixmap, redrawing only the parts that change. \n\
+    --verbose             Report how fast frames were uploaded to the X server. \n\
 \n\
 Multihead Options : \n\
     --extend              Extend the gif, scaled, across all monitors. \n\
@@ -71,6 +135,24 @@ int display_mode = 0;
 // Global to indicate hybrid frame caching mode.
 int hybrid_frame_mode = 0;
 float hybrid_frame_rate = 1.0;
+// Global to indicate palette-indexed storage of partially cached frames.
+int indexed_frame_mode = 0;
+// Global to indicate the number of gif decoding and scaling threads.
+int decode_threads = 1;
+// Global to indicate streaming mode, and how many frames it decodes ahead.
+int stream_depth = 0;
+// Global to indicate the filter used when scaling frames.
+int scale_filter = SCALE_FILTER_NEAREST;
+// Global to indicate that frames are scaled by the X server.
+int xrender_mode = 0;
+// Global to indicate that frames are flipped with the Present extension.
+int present_mode = 0;
+// Global to indicate damage mode, redrawing only what changes between frames.
+int damage_mode = 0;
+// Global to indicate that screen changes are followed through RandR.
+int randr_mode = 0;
+// Global to indicate that load statistics are reported.
+int verbose_mode = 0;
 
 int main(int argc, char **argv)
 {
@@ -152,6 +234,59 @@ int main(int argc, char **argv)
                 return -1;
             }
             break;
+        case 'i':
+            indexed_frame_mode = 1;
+            break;
+        case 'S':
+            stream_depth = strtol(optarg, &endptr, 10);
+            if (*optarg == '\0' || *endptr != '\0' || stream_depth < 1) {
+                printf("Error: stream depth must be a positive integer.\n");
+                return -1;
+            }
+            break;
+        case 'F':
+            if (!strcmp(optarg, "nearest")) {
+                scale_filter = SCALE_FILTER_NEAREST;
+            } else if (!strcmp(optarg, "bilinear")) {
+                scale_filter = SCALE_FILTER_BILINEAR;
+            } else if (!strcmp(optarg, "lanczos")) {
+                scale_filter = SCALE_FILTER_LANCZOS;
+            } else {
+                printf("Error: filter must be nearest, bilinear or lanczos.\n");
+                return -1;
+            }
+            break;
+        case 'X':
+#ifdef HAVE_LIBXRENDER
+            xrender_mode = 1;
+#else
+            printf("Warning: gifpaper was built without XRender, scaling on "
+                   "the client.\n");
+#endif /* HAVE_LIBXRENDER */
+            break;
+        case 'P':
+#ifdef HAVE_LIBXPRESENT
+            present_mode = 1;
+#else
+            printf("Warning: gifpaper was built without Present, flipping "
+                   "frames immediately.\n");
+#endif /* HAVE_LIBXPRESENT */
+            break;
+        case 'D':
+            damage_mode = 1;
+            break;
+        case 'v':
+            verbose_mode = 1;
+            break;
+        case 't':
+            decode_threads = strtol(optarg, &endptr, 10);
+            if (*optarg == '\0' || *endptr != '\0' || decode_threads < 0) {
+                printf("Error: thread count must be a non-negative integer.\n");
+                return -1;
+            }
+            if (!decode_threads)
+                decode_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
         default:
             printf("Error: invalid option at '%s'\n", argv[optind]);
             return -1;
@@ -166,6 +301,26 @@ int main(int argc, char **argv)
 
     init_x();
     init_xinerama();
+#ifdef HAVE_LIBXRENDER
+    // Stream and damage modes lay frames out over the screens as they decode
+    // them.
+    if (xrender_mode && (stream_depth || damage_mode || init_xrender())) {
+        printf("Warning: cannot use XRender, scaling on the client.\n");
+        xrender_mode = 0;
+    }
+#endif /* HAVE_LIBXRENDER */
+#ifdef HAVE_LIBXPRESENT
+    if (present_mode && init_present()) {
+        printf("Warning: cannot use Present, flipping frames immediately.\n");
+        present_mode = 0;
+    }
+#endif /* HAVE_LIBXPRESENT */
+#ifdef HAVE_LIBXRANDR
+    // Only frames loaded into a table are laid out again, the other modes
+    // keep the screens they started with.
+    if (!slideshow_mode && !stream_depth && !damage_mode && !init_randr())
+        randr_mode = 1;
+#endif /* HAVE_LIBXRANDR */
 
     if (slideshow_mode) {
         display_as_slideshow(gifpath, framerate, sliderate);
@@ -15,6 +15,20 @@
 #include <X11/X.h>
 #include <X11/extensions/Xinerama.h>
 #endif /* HAVE_LIBXINERAMA */
+#ifdef HAVE_LIBXEXT
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif /* HAVE_LIBXEXT */
+#ifdef HAVE_LIBXRENDER
+#include <X11/extensions/Xrender.h>
+#endif /* HAVE_LIBXRENDER */
+#ifdef HAVE_LIBXPRESENT
+#include <X11/extensions/Xpresent.h>
+#endif /* HAVE_LIBXPRESENT */
+#ifdef HAVE_LIBXRANDR
+#include <X11/extensions/Xrandr.h>
+#endif /* HAVE_LIBXRANDR */
 
 #include <ctype.h>
 #include <dirent.h>
@@ -22,6 +36,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
@@ -43,8 +58,18 @@
   (((x) >= (rx)) && ((y) >= (ry)) && ((x) < ((rx) + (rw))) &&                  \
    ((y) < ((ry) + (rh))))
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 typedef struct Buffmap {
   uint8_t *buf;
+  // Bytes per pixel of buf: 3 if the visual leaves the top byte of its 32-bit
+  // pixels unused, which is then not stored.
+  int bpp;
   int w;
   int h;
 
@@ -54,20 +79,82 @@ typedef struct Buffmap {
 
 } Buffmap;
 
-#define PIXMAP_FRAME 0 // best runtime performance
-#define BUFFER_FRAME 1 // average memory and runtime performance
-#define QTREE_FRAME 2  // best memory usage, poor runtime performance
+typedef struct Indexmap {
+  uint8_t *idx;
+  // Distinct pixels of the frame, already in the visual's format.
+  uint32_t *palette;
+  int ncolors;
+  int w;
+  int h;
+
+  // Used to maintain a reference when on display
+  uint8_t active;
+  Pixmap pmap;
+
+} Indexmap;
+
+#define PIXMAP_FRAME 0  // best runtime performance
+#define BUFFER_FRAME 1  // average memory and runtime performance
+#define QTREE_FRAME 2   // best memory usage, poor runtime performance
+#define INDEXED_FRAME 3 // low memory usage, average runtime performance
+#define PATCH_FRAME 4   // only the animated area, over the table's base pixmap
 
 typedef struct Frame {
   int type;
   union {
     Buffmap bmap;
+    Indexmap imap;
     Pixmap pmap;
   };
-  struct Frame *next;
-  struct Frame *prev;
+  // Set if the storage belongs to an earlier, identical frame.
+  uint8_t shared;
 } Frame;
 
+// A gif's frames in display order, kept in one allocation along with their
+// metadata. Playback wraps around from the last frame to the first.
+typedef struct FrameTable {
+  Frame *frames;
+  // Hash of each frame's pixels, to find duplicates.
+  uint64_t *hash;
+  // Number of frame periods each frame stays on display.
+  int *hold;
+  int count;
+  int size;
+  // Size of the frames as rendered, before any scaling.
+  int w;
+  int h;
+  // If only part of the gif is animated, the screen-sized pixmap holding the
+  // still part, and the rectangles of it that patch frames cover.
+  Pixmap base;
+  XRectangle *patch;
+  int npatch;
+  // The last frame appended, as rendered, so that a repeat of it is confirmed
+  // pixel by pixel rather than by its hash alone.
+  uint8_t *last;
+  uint64_t last_hash;
+  // The gif the frames were loaded from, kept in memory so that they can be
+  // laid out again when the screens change. Only set for tables loaded in the
+  // background.
+  gd_GIF *gif;
+  // Set once every frame has been appended.
+  int loaded;
+  // Held while appending frames, and while the display loop reads the table.
+  pthread_mutex_t lock;
+  // Signalled whenever count grows, or the table is loaded.
+  pthread_cond_t grown;
+} FrameTable;
+
+#define NEXT_FRAME(t, i) ((i) + 1 < (t)->count ? (i) + 1 : 0)
+#define PREV_FRAME(t, i) ((i) > 0 ? (i) - 1 : (t)->count - 1)
+
+// The screens' geometry at some point, to tell which screens a change moved.
+typedef struct ScreenLayout {
+  XineramaScreenInfo *screens;
+  int count;
+  int width;
+  int height;
+} ScreenLayout;
+
 typedef struct SlideshowEntry {
   char path[200];
   struct SlideshowEntry *next;
@@ -98,13 +185,47 @@ extern int display_mode;
 // Global to indicate hybrid frame caching mode.
 extern int hybrid_frame_mode;
 extern float hybrid_frame_rate;
+// Global to indicate palette-indexed storage of partially cached frames.
+extern int indexed_frame_mode;
+// Global to indicate the number of gif decoding and scaling threads.
+extern int decode_threads;
+// Global to indicate streaming mode, and how many frames it decodes ahead.
+extern int stream_depth;
+// Global to indicate the filter used when scaling frames.
+extern int scale_filter;
+// Global to indicate that frames are scaled by the X server.
+extern int xrender_mode;
+// Global to indicate that frames are flipped with the Present extension.
+extern int present_mode;
+// Global to indicate damage mode, redrawing only what changes between frames.
+extern int damage_mode;
+// Global to indicate that screen changes are followed through RandR.
+extern int randr_mode;
+// Global to indicate that load statistics are reported.
+extern int verbose_mode;
 
 // Define new display modes as needed here.
 #define DISPLAY_MODE_REPLICATE 1
 #define DISPLAY_MODE_EXTEND 2
 
-Frame *append_image_to_list(gd_GIF *gif, Frame *c);
-Frame *load_images_to_list(char *gifpath);
+#define SCALE_FILTER_NEAREST 0
+#define SCALE_FILTER_BILINEAR 1
+#define SCALE_FILTER_LANCZOS 2
+
+FrameTable *new_frame_table(int size);
+int append_image_to_table(gd_GIF *gif, FrameTable *t, int type);
+FrameTable *load_images_to_table(char *gifpath);
+FrameTable *load_images_in_background(char *gifpath);
+#ifdef HAVE_LIBXRANDR
+void relayout_frames(FrameTable *t, int shown, ScreenLayout *old);
+#endif /* HAVE_LIBXRANDR */
+
+// Streaming mode functions.
+int display_as_stream(char *gifpath, long framerate);
+void *stream_decoder_thread(void *args);
+
+// Damage mode functions.
+int display_as_damage(char *gifpath, long framerate);
 
 // Slideshow mode functions.
 SlideshowEntry *load_slideshow_paths(char *gifpath);
@@ -113,7 +234,7 @@ void *slideshow_gif_thread(void *args);
 int display_as_gif(char *gifpath, long framerate);
 int display_as_slideshow(char *dirpath, long framerate, long sliderate);
 void clear_frame(Frame *c);
-void clean_gif_frames(Frame *head);
+void clean_gif_frames(FrameTable *t);
 
 // Power functions.
 int check_power_conditions();
@@ -125,13 +246,24 @@ uint8_t *scale_to_screen(unsigned char *dst, unsigned char *src, int srcWidth,
 void scale(unsigned char *dst, int dstWidth, int dstX, int dstY, int dstW,
            int dstH, unsigned char *src, int srcWidth, int srcX, int srcY,
            int srcW, int srcH);
-uint8_t *crop(unsigned char *src, int srcW, int srcH, int subX, int subY,
-              int subW, int subH);
+int scale_changed(unsigned char *dst, int dstWidth, int dstX, int dstY,
+                  int dstW, int dstH, unsigned char *src, int srcWidth,
+                  int srcX, int srcY, int srcW, int srcH, int x, int y, int w,
+                  int h, XRectangle *out);
+void render_frame(gd_GIF *gif, uint8_t *dst, int stride, int x, int y, int w,
+                  int h);
+void render_frame_to_screen(gd_GIF *gif, uint8_t *screen);
+gd_GIF *open_gif(char *gifpath);
 int count_frames_in_gif(char *gifpath);
 
 // Memory mode functions.
 int generate_frame_pattern(uint8_t *buf, float f_rate);
 void _generate_frame_pattern(uint8_t *buf, int buf_size, int count);
+int choose_frame_type(uint8_t *pattern, int pattern_size, int idx);
+Indexmap generate_imap(uint8_t *buffer, int w, int h);
+uint64_t hash_pixels(const uint8_t *buf, int stride, int w, int h);
+uint8_t *expand_imap(Indexmap *imap);
+uint8_t *expand_bmap(Buffmap *bmap);
 
 // Utility functions.
 struct timespec time_diff(struct timespec start, struct timespec end);
@@ -148,13 +280,56 @@ Buffmap generate_bmap(uint8_t *buffer, int srcW, int srcH);
 extern Pixmap generate_pmap(uint8_t *buffer, int srcW, int srcH);
 extern Pixmap generate_pmap_replicate(uint8_t *buffer, int srcW, int srcH);
 extern Pixmap generate_pmap_extend(uint8_t *buffer, int srcW, int srcH);
+extern int frame_fits_screens(int w, int h);
+extern void fill_screen(uint8_t *screen, uint8_t *buffer, int srcW, int srcH);
+extern void fill_screen_replicate(uint8_t *screen, uint8_t *buffer, int srcW,
+                                  int srcH);
+extern void fill_screen_extend(uint8_t *screen, uint8_t *buffer, int srcW,
+                               int srcH);
+extern int fill_screen_changed(uint8_t *screen, uint8_t *buffer, int srcW,
+                               int srcH, int x, int y, int w, int h,
+                               XRectangle *rects);
+extern int extend_source_rect(int i, int srcW, int srcH, int *x, int *y,
+                              int *w, int *h);
+extern void fill_screen_direct(uint8_t *screen, gd_GIF *gif, int x, int y,
+                               int w, int h);
+extern Pixmap generate_pmap_screen(uint8_t *screen);
+extern Pixmap generate_patch(FrameTable *t, uint8_t *screen);
+extern uint8_t *screen_origin(uint8_t *screen, int i);
+#ifdef HAVE_LIBXRANDR
+extern Pixmap relayout_pmap(Pixmap old, uint8_t *buffer, int srcW, int srcH,
+                            const uint8_t *kept);
+#endif /* HAVE_LIBXRANDR */
 
 Pixmap _generate_pmap(Pixmap pmap, uint8_t *buffer, int x, int y, int w, int h);
+Pixmap new_pixmap(int w, int h);
+size_t uploaded_bytes(void);
 void clear_pmap(Pixmap pmap);
 
-extern int set_background(Frame *frame);
-extern int _set_background(Frame *frame, Frame *prev);
-extern int draw_pmap_to_background(Frame *frame, Frame *prev, Pixmap pmap);
+extern int set_background(FrameTable *t, int i);
+extern int draw_pmap_to_background(Pixmap pmap);
+extern void read_root_events(void);
+extern int check_root_owner(void);
+
+#ifdef HAVE_LIBXRENDER
+extern int init_xrender(void);
+extern Pixmap xrender_scale_to_screen(Pixmap pmap, int w, int h);
+extern int xrender_new_targets(Pixmap *old);
+#endif /* HAVE_LIBXRENDER */
+
+#ifdef HAVE_LIBXPRESENT
+extern int init_present(void);
+extern void present_pmap(Pixmap pmap);
+extern void present_wait_idle(Pixmap pmap);
+extern long long present_take_delay(void);
+extern void present_report(void);
+#endif /* HAVE_LIBXPRESENT */
+
+#ifdef HAVE_LIBXRANDR
+extern int init_randr(void);
+extern int screens_changed(ScreenLayout *old);
+extern int unchanged_screens(ScreenLayout *old, uint8_t *kept);
+#endif /* HAVE_LIBXRANDR */
 
 _XFUNCPROTOEND
 
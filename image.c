@@ -1,5 +1,9 @@
 #include "gifpaper.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 /**
  * A set of functions for transforming gif frames and loading them into a
  * linked list of X11 Pixmaps. Mainly used for preparing the gif to be a
@@ -7,10 +11,9 @@
  */
 
 /**
- * Scales a gif frame to the size of the screen. Returns a freshly malloc'd
- * buffer with the pixels, in BRGA. Note that gifdec provides gifs in RGB.
- *
- * todo: implement antialiasing
+ * Scales a gif frame to the size of the screen, writing it into dst at that
+ * screen's position. Pixels are 32-bit, in the visual's format (see
+ * render_frame()).
  */
 
 uint8_t *scale_to_screen(unsigned char *dst, unsigned char *src, int srcWidth,
@@ -29,70 +32,798 @@ uint8_t *scale_to_screen(unsigned char *dst, unsigned char *src, int srcWidth,
 }
 
 /**
- * Scale a gif frame to a new specified size. X11 accepts buffered data in BGRA
- * format, while gifdec provides frames in RGB; thus, the scaling operation also
- * translates the frame data.
+ * Filter weights along one axis. Destination pixel i blends the taps source
+ * pixels from start[i] on, weighted by weights[i * taps] onwards. Weights are
+ * in 2.14 fixed point and add up to 1 for every pixel.
+ */
+
+typedef struct FilterTaps {
+    int taps;
+    int *start;
+    int16_t *weights;
+} FilterTaps;
+
+/**
+ * Source offsets for one scaling geometry. They are built once per geometry,
+ * taking the divisions out of the per-pixel loop, and kept per thread since
+ * streaming mode scales off the main thread. Screens of different sizes, or
+ * showing different parts of the gif, each have a geometry of their own, so a
+ * thread keeps a map for each.
+ */
+
+typedef struct ScaleMap {
+    int srcW, srcH, dstW, dstH, filter;
+    int *cols;    // The source column for each destination column.
+    int *rows;    // The source row for each destination row.
+    FilterTaps x; // Column weights, if filtering.
+    FilterTaps y; // Row weights, if filtering.
+} ScaleMap;
+
+#define SCALE_MAPS_MIN 4
+
+static __thread ScaleMap *scale_maps = NULL;
+static __thread int num_scale_maps = 0;
+static __thread int scale_maps_size = 0;
+static __thread int next_scale_map = 0; // The map to replace when full.
+
+static double filter_kernel(int filter, double x)
+{
+    x = fabs(x);
+    if (filter == SCALE_FILTER_BILINEAR)
+        return x < 1.0 ? 1.0 - x : 0.0;
+
+    // Lanczos-3.
+    if (x < 1e-8)
+        return 1.0;
+    if (x >= 3.0)
+        return 0.0;
+    return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+}
+
+/**
+ * Builds the weights for scaling src pixels to dst pixels along one axis. When
+ * shrinking, the kernel is stretched to cover every source pixel. Near the
+ * edges the window is moved inwards rather than reading past them.
+ */
+
+static void build_filter_taps(FilterTaps *t, int filter, int src, int dst)
+{
+    double ratio = (double)src / dst;
+    double stretch = ratio > 1.0 ? ratio : 1.0;
+    double support = (filter == SCALE_FILTER_BILINEAR ? 1.0 : 3.0) * stretch;
+
+    t->taps = (int)ceil(support * 2);
+    if (t->taps > src)
+        t->taps = src;
+    t->start = (int *)malloc(dst * sizeof(int));
+    t->weights = (int16_t *)malloc(dst * t->taps * sizeof(int16_t));
+
+    double w[t->taps];
+    for (int i = 0; i < dst; i++) {
+        double center = (i + 0.5) * ratio - 0.5;
+        int first = (int)floor(center - support) + 1;
+        if (first > src - t->taps)
+            first = src - t->taps;
+        if (first < 0)
+            first = 0;
+
+        double sum = 0;
+        for (int j = 0; j < t->taps; j++) {
+            w[j] = filter_kernel(filter, (first + j - center) / stretch);
+            sum += w[j];
+        }
+
+        // Round to fixed point, putting the rounding error on the largest
+        // weight so that flat colors stay exact.
+        int16_t *q = &t->weights[i * t->taps];
+        int total = 0, largest = 0;
+        for (int j = 0; j < t->taps; j++) {
+            q[j] = (int16_t)lround(w[j] / sum * (1 << 14));
+            total += q[j];
+            if (q[j] > q[largest])
+                largest = j;
+        }
+        q[largest] += (1 << 14) - total;
+        t->start[i] = first;
+    }
+}
+
+static void free_scale_map(ScaleMap *m)
+{
+    free(m->cols);
+    free(m->rows);
+    free(m->x.start);
+    free(m->x.weights);
+    free(m->y.start);
+    free(m->y.weights);
+}
+
+/**
+ * Finds the map for a geometry, building it if the thread has none. There is
+ * room for one per screen, and a spare; once full, maps are replaced in turn,
+ * which still keeps them all when the screens are scaled in the same order
+ * every frame. Returns NULL if out of memory.
+ */
+
+static ScaleMap *get_scale_map(int srcW, int srcH, int dstW, int dstH,
+                               int filter)
+{
+    for (int i = 0; i < num_scale_maps; i++) {
+        ScaleMap *m = &scale_maps[i];
+        if (m->srcW == srcW && m->srcH == srcH && m->dstW == dstW &&
+            m->dstH == dstH && m->filter == filter)
+            return m;
+    }
+
+    int size = SCALE_MAPS_MIN;
+#ifdef HAVE_LIBXINERAMA
+    if (size < num_xinerama_screens + 1)
+        size = num_xinerama_screens + 1;
+#endif /* HAVE_LIBXINERAMA */
+    if (num_scale_maps == scale_maps_size && scale_maps_size < size) {
+        ScaleMap *tmp = realloc(scale_maps, size * sizeof(ScaleMap));
+        if (tmp) {
+            scale_maps = tmp;
+            scale_maps_size = size;
+        }
+    }
+
+    ScaleMap *m;
+    if (num_scale_maps < scale_maps_size) {
+        m = &scale_maps[num_scale_maps++];
+    } else if (num_scale_maps) {
+        m = &scale_maps[next_scale_map];
+        next_scale_map = (next_scale_map + 1) % num_scale_maps;
+        free_scale_map(m);
+    } else {
+        return NULL;
+    }
+
+    memset(m, 0, sizeof(ScaleMap));
+    m->cols = (int *)malloc(dstW * sizeof(int));
+    m->rows = (int *)malloc(dstH * sizeof(int));
+    for (int x = 0; x < dstW; x++)
+        m->cols[x] = (int)((int64_t)x * srcW / dstW);
+    for (int y = 0; y < dstH; y++)
+        m->rows[y] = (int)((int64_t)y * srcH / dstH);
+    if (filter) {
+        build_filter_taps(&m->x, filter, srcW, dstW);
+        build_filter_taps(&m->y, filter, srcH, dstH);
+    }
+    m->srcW = srcW;
+    m->srcH = srcH;
+    m->dstW = dstW;
+    m->dstH = dstH;
+    m->filter = filter;
+
+    return m;
+}
+
+static void scale_row(uint32_t *d, const uint32_t *s, const int *cols, int n)
+{
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        d[x + 0] = s[cols[x + 0]];
+        d[x + 1] = s[cols[x + 1]];
+        d[x + 2] = s[cols[x + 2]];
+        d[x + 3] = s[cols[x + 3]];
+    }
+    for (; x < n; x++)
+        d[x] = s[cols[x]];
+}
+
+// Integer upscaling: every source pixel becomes k destination pixels.
+static void repeat_row(uint32_t *d, const uint32_t *s, int k, int n)
+{
+    for (int x = 0; x < n; x++, d += k)
+        for (int j = 0; j < k; j++)
+            d[j] = s[x];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 has no gather, so nearest-neighbour rows keep the unrolled scale_row().
+__attribute__((target("sse2"))) static void
+repeat_row_sse2(uint32_t *d, const uint32_t *s, int k, int n)
+{
+    int x = 0;
+    if (k == 2) {
+        for (; x + 2 <= n; x += 2, d += 4) {
+            __m128i v = _mm_loadl_epi64((const __m128i *)&s[x]);
+            _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi32(v, v));
+        }
+    } else if (k >= 4) {
+        for (; x < n; x++, d += k) {
+            __m128i v = _mm_set1_epi32((int)s[x]);
+            int j = 0;
+            for (; j + 4 <= k; j += 4)
+                _mm_storeu_si128((__m128i *)&d[j], v);
+            for (; j < k; j++)
+                d[j] = s[x];
+        }
+    }
+    repeat_row(d, &s[x], k, n - x);
+}
+
+__attribute__((target("avx2"))) static void
+scale_row_avx2(uint32_t *d, const uint32_t *s, const int *cols, int n)
+{
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&cols[x]);
+        _mm256_storeu_si256((__m256i *)&d[x],
+                            _mm256_i32gather_epi32((const int *)s, v, 4));
+    }
+    scale_row(&d[x], s, &cols[x], n - x);
+}
+
+__attribute__((target("avx2"))) static void
+repeat_row_avx2(uint32_t *d, const uint32_t *s, int k, int n)
+{
+    int x = 0;
+    if (8 % k == 0) {
+        // k is 2, 4 or 8: 8 / k source pixels make up 8 destination pixels.
+        const __m256i idx = _mm256_setr_epi32(0 / k, 1 / k, 2 / k, 3 / k,
+                                              4 / k, 5 / k, 6 / k, 7 / k);
+        for (; x + 4 <= n; x += 8 / k, d += 8) {
+            __m256i v = _mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)&s[x]));
+            _mm256_storeu_si256((__m256i *)d,
+                                _mm256_permutevar8x32_epi32(v, idx));
+        }
+    } else if (k > 8) {
+        for (; x < n; x++, d += k) {
+            __m256i v = _mm256_set1_epi32((int)s[x]);
+            int j = 0;
+            for (; j + 8 <= k; j += 8)
+                _mm256_storeu_si256((__m256i *)&d[j], v);
+            for (; j < k; j++)
+                d[j] = s[x];
+        }
+    }
+    repeat_row(d, &s[x], k, n - x);
+}
+#endif
+
+/**
+ * The filtered scaler works in two passes. The horizontal pass blends each
+ * channel of a source row into 10.6 fixed point, and the vertical pass blends
+ * those rows into the destination, rounding and clamping back to bytes.
+ */
+
+static void filter_row_h(int16_t *out, const uint8_t *s, const FilterTaps *t,
+                         int n)
+{
+    for (int i = 0; i < n; i++) {
+        const uint8_t *p = &s[t->start[i] * 4];
+        const int16_t *w = &t->weights[i * t->taps];
+        int acc[4] = {1 << 7, 1 << 7, 1 << 7, 1 << 7};
+        for (int j = 0; j < t->taps; j++)
+            for (int c = 0; c < 4; c++)
+                acc[c] += w[j] * p[j * 4 + c];
+        for (int c = 0; c < 4; c++)
+            out[i * 4 + c] = (int16_t)(acc[c] >> 8);
+    }
+}
+
+static void filter_row_v(uint8_t *d, int16_t **rows, const int16_t *w,
+                         int taps, int from, int n)
+{
+    for (int i = from; i < n; i++) {
+        int acc = 1 << 19;
+        for (int j = 0; j < taps; j++)
+            acc += w[j] * rows[j][i];
+        acc >>= 20;
+        d[i] = acc < 0 ? 0 : acc > 255 ? 255 : acc;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static void
+filter_row_h_sse2(int16_t *out, const uint8_t *s, const FilterTaps *t, int n)
+{
+    const __m128i z = _mm_setzero_si128();
+
+    for (int i = 0; i < n; i++) {
+        const uint8_t *p = &s[t->start[i] * 4];
+        const int16_t *w = &t->weights[i * t->taps];
+        __m128i acc = _mm_set1_epi32(1 << 7);
+        int j = 0;
+        for (; j + 2 <= t->taps; j += 2) {
+            // Widens two pixels and interleaves their channels, as in AVX2.
+            __m128i px = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)&p[j * 4]), z);
+            px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+            __m128i wj =
+                _mm_set1_epi32((uint16_t)w[j] | (uint32_t)(uint16_t)w[j + 1]
+                                                    << 16);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, wj));
+        }
+        if (j < t->taps) {
+            int32_t px;
+            memcpy(&px, &p[j * 4], 4);
+            __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(px), z);
+            acc = _mm_add_epi32(
+                acc, _mm_madd_epi16(_mm_unpacklo_epi16(v, z),
+                                    _mm_set1_epi32((uint16_t)w[j])));
+        }
+        acc = _mm_srai_epi32(acc, 8);
+        _mm_storel_epi64((__m128i *)&out[i * 4], _mm_packs_epi32(acc, acc));
+    }
+}
+
+__attribute__((target("sse2"))) static void
+filter_row_v_sse2(uint8_t *d, int16_t **rows, const int16_t *w, int taps,
+                  int from, int n)
+{
+    int i = from;
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_set1_epi32(1 << 19), hi = lo;
+        int j = 0;
+        for (; j + 2 <= taps; j += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i *)&rows[j][i]);
+            __m128i b = _mm_loadu_si128((const __m128i *)&rows[j + 1][i]);
+            __m128i wj = _mm_set1_epi32((uint16_t)w[j] |
+                                        (uint32_t)(uint16_t)w[j + 1] << 16);
+            lo = _mm_add_epi32(lo,
+                               _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wj));
+            hi = _mm_add_epi32(hi,
+                               _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wj));
+        }
+        if (j < taps) {
+            __m128i a = _mm_loadu_si128((const __m128i *)&rows[j][i]);
+            __m128i z = _mm_setzero_si128();
+            __m128i wj = _mm_set1_epi32((uint16_t)w[j]);
+            lo = _mm_add_epi32(lo,
+                               _mm_madd_epi16(_mm_unpacklo_epi16(a, z), wj));
+            hi = _mm_add_epi32(hi,
+                               _mm_madd_epi16(_mm_unpackhi_epi16(a, z), wj));
+        }
+        __m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, 20),
+                                    _mm_srai_epi32(hi, 20));
+        _mm_storel_epi64((__m128i *)&d[i], _mm_packus_epi16(v, v));
+    }
+    filter_row_v(d, rows, w, taps, i, n);
+}
+
+__attribute__((target("avx2"))) static void
+filter_row_h_avx2(int16_t *out, const uint8_t *s, const FilterTaps *t, int n)
+{
+    // Interleaves the channels of two pixels, so one madd weighs both.
+    const __m128i pair =
+        _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    for (int i = 0; i < n; i++) {
+        const uint8_t *p = &s[t->start[i] * 4];
+        const int16_t *w = &t->weights[i * t->taps];
+        __m128i acc = _mm_set1_epi32(1 << 7);
+        int j = 0;
+        for (; j + 2 <= t->taps; j += 2) {
+            __m128i px = _mm_cvtepu8_epi16(_mm_shuffle_epi8(
+                _mm_loadl_epi64((const __m128i *)&p[j * 4]), pair));
+            __m128i wj =
+                _mm_set1_epi32((uint16_t)w[j] | (uint32_t)(uint16_t)w[j + 1]
+                                                    << 16);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, wj));
+        }
+        if (j < t->taps) {
+            int32_t px;
+            memcpy(&px, &p[j * 4], 4);
+            acc = _mm_add_epi32(
+                acc, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(px)),
+                                     _mm_set1_epi32(w[j])));
+        }
+        acc = _mm_srai_epi32(acc, 8);
+        _mm_storel_epi64((__m128i *)&out[i * 4], _mm_packs_epi32(acc, acc));
+    }
+}
+
+__attribute__((target("avx2"))) static void
+filter_row_v_avx2(uint8_t *d, int16_t **rows, const int16_t *w, int taps,
+                  int from, int n)
+{
+    int i = from;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_set1_epi32(1 << 19), hi = lo;
+        int j = 0;
+        for (; j + 2 <= taps; j += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)&rows[j][i]);
+            __m256i b = _mm256_loadu_si256((const __m256i *)&rows[j + 1][i]);
+            __m256i wj = _mm256_set1_epi32((uint16_t)w[j] |
+                                           (uint32_t)(uint16_t)w[j + 1] << 16);
+            lo = _mm256_add_epi32(
+                lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wj));
+            hi = _mm256_add_epi32(
+                hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wj));
+        }
+        if (j < taps) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)&rows[j][i]);
+            __m256i z = _mm256_setzero_si256();
+            __m256i wj = _mm256_set1_epi32((uint16_t)w[j]);
+            lo = _mm256_add_epi32(
+                lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, z), wj));
+            hi = _mm256_add_epi32(
+                hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, z), wj));
+        }
+        // The unpacks work within 128-bit lanes; packing restores the order
+        // of the 16-bit values and the permute that of the bytes.
+        __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(lo, 20),
+                                       _mm256_srai_epi32(hi, 20));
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v),
+                                     _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)&d[i], _mm256_castsi256_si128(v));
+    }
+    filter_row_v(d, rows, w, taps, i, n);
+}
+#endif
+
+static void (*gather)(uint32_t *, const uint32_t *, const int *, int);
+static void (*repeat)(uint32_t *, const uint32_t *, int, int);
+static void (*filter_h)(int16_t *, const uint8_t *, const FilterTaps *, int);
+static void (*filter_v)(uint8_t *, int16_t **, const int16_t *, int, int, int);
+
+/**
+ * One scale() call, as handed to the scaling pool. Only the x0 to x1 and y0 to
+ * y1 part of the destination rectangle is scaled.
+ */
+
+typedef struct ScaleJob {
+    unsigned char *dst, *src;
+    int dstWidth, dstX, dstY, dstW, dstH;
+    int srcWidth, srcX, srcY, srcW, srcH;
+    ScaleMap *map;
+    int x0, x1, y0, y1;
+} ScaleJob;
+
+/**
+ * Filters destination rows y0 to y1 of a job, running the horizontal pass over
+ * just the source rows they read.
+ */
+
+static void filter_band(ScaleJob *j, int y0, int y1)
+{
+    ScaleMap *m = j->map;
+    int n = (j->x1 - j->x0) * 4;
+    int first = m->y.start[y0];
+    int last = m->y.start[y1 - 1] + m->y.taps;
+    // The column weights of just the columns being scaled.
+    FilterTaps x = {m->x.taps, &m->x.start[j->x0],
+                    &m->x.weights[j->x0 * m->x.taps]};
+
+    int16_t *tmp = (int16_t *)malloc((size_t)(last - first) * n * 2);
+    for (int r = first; r < last; r++)
+        filter_h(&tmp[(r - first) * n],
+                 j->src + ((j->srcY + r) * j->srcWidth + j->srcX) * 4, &x,
+                 j->x1 - j->x0);
+
+    int16_t *rows[m->y.taps];
+    for (int y = y0; y < y1; y++) {
+        for (int t = 0; t < m->y.taps; t++)
+            rows[t] = &tmp[(m->y.start[y] + t - first) * n];
+        filter_v(j->dst +
+                     ((j->dstY + y) * j->dstWidth + j->dstX + j->x0) * 4,
+                 rows, &m->y.weights[y * m->y.taps], m->y.taps, 0, n);
+    }
+    free(tmp);
+}
+
+/**
+ * Scales destination rows y0 to y1 of a job. A band only depends on its own
+ * rows, so bands can be scaled at the same time.
+ */
+
+static void scale_band(ScaleJob *j, int y0, int y1)
+{
+    ScaleMap *m = j->map;
+    if (y0 >= y1)
+        return;
+    if (m->filter) {
+        filter_band(j, y0, y1);
+        return;
+    }
+    int n = j->x1 - j->x0;
+    // Whole rows can be copied or repeated, parts of them are gathered.
+    int k = 0;
+    if (n == j->dstW && j->dstW % j->srcW == 0)
+        k = j->dstW / j->srcW;
+
+    for (int y = y0; y < y1; y++) {
+        uint32_t *d = (uint32_t *)j->dst + (j->dstY + y) * j->dstWidth +
+                      j->dstX + j->x0;
+        if (y > y0 && m->rows[y] == m->rows[y - 1]) {
+            memcpy(d, d - j->dstWidth, n * 4);
+            continue;
+        }
+        uint32_t *s = (uint32_t *)j->src +
+                      (j->srcY + m->rows[y]) * j->srcWidth + j->srcX;
+        if (k == 1)
+            memcpy(d, s, n * 4);
+        else if (k)
+            repeat(d, s, k, j->srcW);
+        else
+            gather(d, s, &m->cols[j->x0], n);
+    }
+}
+
+/**
+ * The scaling pool. Its threads are started on first use and kept for the life
+ * of the process. Each job is split into one band of rows per thread, the
+ * thread submitting it taking the first band. Only one job runs at a time.
+ */
+
+static struct {
+    pthread_mutex_t submit; // Held while a job is in the pool.
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    ScaleJob job;
+    unsigned generation; // Bumped for every job.
+    int pending;         // Bands of the current job still being scaled.
+    int nthreads;        // Including the submitting thread, 0 if not started.
+} scale_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+                PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// Frames smaller than this are scaled without waking the pool.
+#define SCALE_POOL_MIN_PIXELS (256 * 256)
+
+static void *scale_thread(void *args)
+{
+    int band = (int)(intptr_t)args;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&scale_pool.lock);
+    while (True) {
+        while (scale_pool.generation == seen)
+            pthread_cond_wait(&scale_pool.work, &scale_pool.lock);
+        seen = scale_pool.generation;
+        ScaleJob j = scale_pool.job;
+        int n = scale_pool.nthreads;
+        pthread_mutex_unlock(&scale_pool.lock);
+
+        int rows = j.y1 - j.y0;
+        scale_band(&j, j.y0 + rows * band / n, j.y0 + rows * (band + 1) / n);
+
+        pthread_mutex_lock(&scale_pool.lock);
+        if (--scale_pool.pending == 0)
+            pthread_cond_signal(&scale_pool.done);
+    }
+
+    return NULL;
+}
+
+static void start_scale_pool(int nthreads)
+{
+    pthread_t tid;
+    int started = 1;
+
+    for (; started < nthreads; started++) {
+        if (pthread_create(&tid, NULL, scale_thread, (void *)(intptr_t)started))
+            break;
+        pthread_detach(tid);
+    }
+    scale_pool.nthreads = started;
+}
+
+static void scale_in_pool(ScaleJob *j)
+{
+    pthread_mutex_lock(&scale_pool.submit);
+    if (!scale_pool.nthreads)
+        start_scale_pool(decode_threads);
+    int n = scale_pool.nthreads;
+
+    pthread_mutex_lock(&scale_pool.lock);
+    scale_pool.job = *j;
+    scale_pool.pending = n - 1;
+    scale_pool.generation++;
+    pthread_cond_broadcast(&scale_pool.work);
+    pthread_mutex_unlock(&scale_pool.lock);
+
+    scale_band(j, j->y0, j->y0 + (j->y1 - j->y0) / n);
+
+    pthread_mutex_lock(&scale_pool.lock);
+    while (scale_pool.pending)
+        pthread_cond_wait(&scale_pool.done, &scale_pool.lock);
+    pthread_mutex_unlock(&scale_pool.lock);
+    pthread_mutex_unlock(&scale_pool.submit);
+}
+
+// Filtering blends each byte of a pixel on its own, so the visual's channels
+// have to be whole bytes.
+static int channels_are_bytes(void)
+{
+    unsigned long masks[3] = {vis->red_mask, vis->green_mask, vis->blue_mask};
+    for (int i = 0; i < 3; i++)
+        if (masks[i] != 0xff && masks[i] != 0xff00 && masks[i] != 0xff0000 &&
+            masks[i] != 0xff000000)
+            return 0;
+    return 1;
+}
+
+// Picks the row kernels, and the geometry's tables for the job. Returns -1 if
+// there is no memory for the tables.
+static int prepare_scale(ScaleJob *j)
+{
+    if (!gather) {
+        gather = scale_row;
+        repeat = repeat_row;
+        filter_h = filter_row_h;
+        filter_v = filter_row_v;
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("sse2")) {
+            repeat = repeat_row_sse2;
+            filter_h = filter_row_h_sse2;
+            filter_v = filter_row_v_sse2;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            gather = scale_row_avx2;
+            repeat = repeat_row_avx2;
+            filter_h = filter_row_h_avx2;
+            filter_v = filter_row_v_avx2;
+        }
+#endif
+    }
+
+    int filter = scale_filter;
+    if ((j->srcW == j->dstW && j->srcH == j->dstH) || !channels_are_bytes())
+        filter = SCALE_FILTER_NEAREST;
+
+    j->map = get_scale_map(j->srcW, j->srcH, j->dstW, j->dstH, filter);
+
+    return j->map ? 0 : -1;
+}
+
+// Scales the job's part of the destination, across the pool if it is large.
+static void run_scale(ScaleJob *j)
+{
+    if (decode_threads > 1 &&
+        (j->x1 - j->x0) * (j->y1 - j->y0) >= SCALE_POOL_MIN_PIXELS)
+        scale_in_pool(j);
+    else
+        scale_band(j, j->y0, j->y1);
+}
+
+/**
+ * Scale a gif frame to a new specified size. Both buffers hold 32-bit pixels
+ * already in the visual's format, so nearest neighbour scaling only has to pick
+ * source pixels. Rows that need no horizontal scaling are copied whole,
+ * integer upscales repeat each source pixel, and everything else is looked up
+ * through the geometry's column table, with AVX2 gathers when the CPU has
+ * them. A destination row that uses the same source row as the one above it is
+ * copied from there.
  *
- * todo: implement antialiasing
+ * With a bilinear or Lanczos filter selected, the frame is instead filtered in
+ * two fixed-point passes using the geometry's weight tables. Either way, with
+ * more than one thread the rows are split across the scaling pool.
  */
 
 void scale(unsigned char *dst, int dstWidth, int dstX, int dstY, int dstW,
            int dstH, unsigned char *src, int srcWidth, int srcX, int srcY,
            int srcW, int srcH)
 {
-    for (int y = 0; y < dstH; y++) {
-        for (int x = 0; x < dstW; x++) {
-            int indexDst = ((dstY + y) * dstWidth + (dstX + x)) * 4;
-            int indexSrc = ((srcY + (y * srcH / dstH)) * srcWidth +
-                            (srcX + (x * srcW / dstW))) *
-                           3;
-            dst[indexDst + 2] = src[indexSrc + 0];
-            dst[indexDst + 1] = src[indexSrc + 1];
-            dst[indexDst + 0] = src[indexSrc + 2];
-        }
-    }
+    ScaleJob j = {dst,      src,  dstWidth, dstX, dstY, dstW, dstH,
+                  srcWidth, srcX, srcY,     srcW, srcH, NULL};
+    if (prepare_scale(&j))
+        return;
+    j.x0 = 0;
+    j.x1 = dstW;
+    j.y0 = 0;
+    j.y1 = dstH;
+    run_scale(&j);
 }
 
 /**
- * Crop a gif frame to a new specified size. Note that this function expects gif
- * frames in RGB format; thus, crop operations must take place before the final
- * scaling operations.
+ * Finds the destination pixels, out of n, that read any of source pixels a to
+ * b, given the first source pixel each one reads and how many it reads.
+ * Returns 0 if there are none.
  */
 
-uint8_t *crop(unsigned char *src, int srcW, int srcH, int subX, int subY,
-              int subW, int subH)
+static int changed_span(const int *start, int taps, int n, int a, int b,
+                        int *from, int *to)
 {
-    uint8_t *dst = (uint8_t *)malloc(subW * subH * 3);
-    int dst_idx = 0;
+    int i = 0;
+    while (i < n && start[i] + taps <= a)
+        i++;
+    *from = i;
+    while (i < n && start[i] < b)
+        i++;
+    *to = i;
 
-    int src_idx = subY * (srcW * 3) + (subX * 3);
-    for (int i = subY; i < subY + subH; i++) {
-        memcpy(&dst[dst_idx], &src[src_idx], subW * 3);
+    return *to > *from;
+}
 
-        src_idx += srcW * 3;
-        dst_idx += subW * 3;
-    }
+/**
+ * Like scale(), for a frame that was scaled to the same place before and of
+ * which only the (x, y, w, h) part of the source rectangle changed since. Only
+ * the destination pixels that read from that part are scaled again. Stores the
+ * rectangle of dst that was redrawn in out, and returns 0 if there was none.
+ * If dst is NULL, the rectangle is only found.
+ */
 
-    return dst;
+int scale_changed(unsigned char *dst, int dstWidth, int dstX, int dstY,
+                  int dstW, int dstH, unsigned char *src, int srcWidth,
+                  int srcX, int srcY, int srcW, int srcH, int x, int y, int w,
+                  int h, XRectangle *out)
+{
+    ScaleJob j = {dst,      src,  dstWidth, dstX, dstY, dstW, dstH,
+                  srcWidth, srcX, srcY,     srcW, srcH, NULL};
+    if (prepare_scale(&j))
+        return 0;
+
+    ScaleMap *m = j.map;
+    int found;
+    if (m->filter)
+        found = changed_span(m->x.start, m->x.taps, dstW, x, x + w, &j.x0,
+                             &j.x1) &&
+                changed_span(m->y.start, m->y.taps, dstH, y, y + h, &j.y0,
+                             &j.y1);
+    else
+        found = changed_span(m->cols, 1, dstW, x, x + w, &j.x0, &j.x1) &&
+                changed_span(m->rows, 1, dstH, y, y + h, &j.y0, &j.y1);
+    if (!found)
+        return 0;
+    if (dst)
+        run_scale(&j);
+
+    out->x = dstX + j.x0;
+    out->y = dstY + j.y0;
+    out->width = j.x1 - j.x0;
+    out->height = j.y1 - j.y0;
+
+    return 1;
+}
+
+/**
+ * Renders the (x, y, w, h) part of the current gif frame straight into dst as
+ * 32-bit pixels matching the visual's color masks, which is the format X
+ * expects for ZPixmap images. Rows of dst are stride bytes apart.
+ */
+
+void render_frame(gd_GIF *gif, uint8_t *dst, int stride, int x, int y, int w,
+                  int h)
+{
+    gd_render_rect_32(gif, dst, stride, x, y, w, h, vis->red_mask,
+                      vis->green_mask, vis->blue_mask);
 }
 
 /**
- * Counts the number of frames in the gif, by cycling through gifdec's linked
- * list.
+ * Opens a gif for display. A path of "-" reads the gif from standard input, so
+ * that it can be fed through a pipe.
+ */
+
+gd_GIF *open_gif(char *gifpath)
+{
+    if (!strcmp(gifpath, "-"))
+        return gd_open_gif_fd(STDIN_FILENO);
+    return gd_open_gif(gifpath);
+}
+
+/**
+ * Counts the number of frames in the gif, using gifdec's frame index rather
+ * than decoding every frame. Returns -1 if the gif cannot be read.
  */
 
 int count_frames_in_gif(char *gifpath)
 {
     int file_count;
     gd_GIF *gif = gd_open_gif(gifpath);
-    for (file_count = 0; gd_get_frame(gif); file_count++) {
-    }
+    if (!gif)
+        return -1;
+    file_count = gd_index_frames(gif);
     gd_close_gif(gif);
     return file_count;
 }
 
 void clear_frame(Frame *c)
 {
+    // Shared storage belongs to an earlier frame, only the temporary pixmap
+    // of a buffer or indexed frame is this frame's own.
+    if (c->shared) {
+        if (c->type == BUFFER_FRAME && c->bmap.active)
+            clear_pmap(c->bmap.pmap);
+        else if (c->type == INDEXED_FRAME && c->imap.active)
+            clear_pmap(c->imap.pmap);
+        return;
+    }
+
     switch (c->type) {
     case PIXMAP_FRAME:
         clear_pmap(c->pmap);
@@ -102,24 +833,32 @@ void clear_frame(Frame *c)
         if (c->bmap.active)
             clear_pmap(c->bmap.pmap);
         break;
+    case INDEXED_FRAME:
+        free(c->imap.idx);
+        free(c->imap.palette);
+        if (c->imap.active)
+            clear_pmap(c->imap.pmap);
+        break;
     default:
         clear_pmap(c->pmap);
         break;
     }
 }
 
-void clean_gif_frames(Frame *head)
+void clean_gif_frames(FrameTable *t)
 {
-    Frame *c = head->next;
-    Frame *temp;
-    while (c != head) {
-        temp = c->next;
-        clear_frame(c);
-        free(c);
-        c = temp;
-    }
-    clear_frame(head);
-    free(head);
+    for (int i = 0; i < t->count; i++)
+        clear_frame(&t->frames[i]);
+    if (t->base)
+        clear_pmap(t->base);
+    free(t->patch);
+    free(t->last);
+    if (t->gif)
+        gd_close_gif(t->gif);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->grown);
+    free(t->frames);
+    free(t);
 }
 
 /**
@@ -155,109 +894,752 @@ SlideshowEntry *load_slideshow_paths(char *gifpath)
     return head;
 }
 
-Frame *append_image_to_list(gd_GIF *gif, Frame *c)
+/**
+ * Renders the current gif frame, cropped and scaled for display, into a
+ * screen-sized buffer. Makes no X calls.
+ */
+
+void render_frame_to_screen(gd_GIF *gif, uint8_t *screen)
 {
-    uint8_t *buffer = (uint8_t *)malloc(gif->width * gif->height * 4);
-    gd_render_frame(gif, buffer);
-    // todo: handle cropping, once a config file exists
-    switch (c->type) {
-    case PIXMAP_FRAME:
-        c->pmap = generate_pmap(buffer, gif->width, gif->height);
+    int x = 0, y = 0, w = gif->width, h = gif->height;
+
+    if (crop_mode) {
+        x = crop_params[0];
+        y = crop_params[1];
+        w = crop_params[2];
+        h = crop_params[3];
+    }
+
+    if (frame_fits_screens(w, h)) {
+        fill_screen_direct(screen, gif, x, y, w, h);
+        return;
+    }
+
+    uint8_t *buffer = (uint8_t *)malloc(w * h * 4);
+    render_frame(gif, buffer, w * 4, x, y, w, h);
+    fill_screen(screen, buffer, w, h);
+    free(buffer);
+}
+
+/**
+ * Moves the table into an allocation for size frames. The frames and their
+ * metadata arrays share that single allocation.
+ */
+
+static int resize_frame_table(FrameTable *t, int size)
+{
+    size_t each = sizeof(Frame) + sizeof(uint64_t) + sizeof(int);
+    Frame *frames = (Frame *)malloc(size * each);
+    if (!frames)
+        return -1;
+    uint64_t *hash = (uint64_t *)&frames[size];
+    int *hold = (int *)&hash[size];
+
+    if (t->count) {
+        memcpy(frames, t->frames, t->count * sizeof(Frame));
+        memcpy(hash, t->hash, t->count * sizeof(uint64_t));
+        memcpy(hold, t->hold, t->count * sizeof(int));
+    }
+    free(t->frames);
+    t->frames = frames;
+    t->hash = hash;
+    t->hold = hold;
+    t->size = size;
+
+    return 0;
+}
+
+/**
+ * Creates an empty frame table with room for size frames. It grows as needed,
+ * so size may be 0 if it is not known.
+ */
+
+FrameTable *new_frame_table(int size)
+{
+    FrameTable *t = (FrameTable *)calloc(1, sizeof(FrameTable));
+    if (!t)
+        return NULL;
+    if (size > 0 && resize_frame_table(t, size)) {
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->grown, NULL);
+    return t;
+}
+
+/**
+ * A frame that has been decoded and laid out, but not stored yet. Pixmap
+ * frames are laid out over the screens, unless the server scales them; the
+ * other types keep the w x h frame as it was rendered.
+ */
+
+typedef struct PreparedFrame {
+    int type;
+    int w, h;
+    uint64_t hash;
+    int dup;       // Set if it repeats the frame before it.
+    int laid_out;  // Set if pixels is laid out over the screens.
+    uint8_t *pixels;
+} PreparedFrame;
+
+/**
+ * Returns whether two w x h frames of 32-bit pixels are the same. The first is
+ * packed, the second's rows are stride bytes apart.
+ */
+
+static int same_pixels(const uint8_t *a, const uint8_t *b, int stride, int w,
+                       int h)
+{
+    for (int y = 0; y < h; y++)
+        if (memcmp(&a[y * w * 4], &b[y * stride], w * 4))
+            return 0;
+    return 1;
+}
+
+/**
+ * Returns whether the earlier frame f holds the same w x h pixels as a frame
+ * that is not laid out. Only frames that keep their
+ * pixels on the client can be compared; a match of hashes alone is not trusted.
+ */
+
+static int frame_has_pixels(Frame *f, const uint8_t *pixels, int w, int h)
+{
+    uint8_t *buffer;
+    int same;
+
+    switch (f->type) {
+    case BUFFER_FRAME:
+        if (f->bmap.w != w || f->bmap.h != h)
+            return 0;
+        buffer = expand_bmap(&f->bmap);
+        same = buffer && same_pixels(buffer, pixels, w * 4, w, h);
+        if (buffer != f->bmap.buf)
+            free(buffer);
+        return same;
+    case INDEXED_FRAME:
+        if (f->imap.w != w || f->imap.h != h)
+            return 0;
+        buffer = expand_imap(&f->imap);
+        same = buffer && same_pixels(buffer, pixels, w * 4, w, h);
         free(buffer);
+        return same;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Looks for an earlier frame of the table with the same pixels as frame i, the
+ * one being appended. A run of identical frames becomes a single frame that is
+ * held for longer, so it is not redrawn; other duplicates share the earlier
+ * frame's storage, if its pixels are still there to confirm that they match.
+ * Returns the index of the frame now showing the image, or -1
+ * if it is not a duplicate. Must be called with the table locked, since the
+ * display loop may be using the earlier frames.
+ */
+
+static int reuse_duplicate(FrameTable *t, int i, PreparedFrame *p)
+{
+    Frame *c = &t->frames[i];
+
+    if (p->dup) {
+        t->hold[i - 1]++;
+        return i - 1;
+    }
+    if (p->laid_out)
+        return -1;
+
+    for (int j = i - 2; j >= 0; j--) {
+        Frame *f = &t->frames[j];
+        if (t->hash[j] != t->hash[i] ||
+            !frame_has_pixels(f, p->pixels, p->w, p->h))
+            continue;
+        c->type = f->type;
+        switch (f->type) {
+        case BUFFER_FRAME:
+            c->bmap = f->bmap;
+            c->bmap.active = 0;
+            break;
+        case INDEXED_FRAME:
+            c->imap = f->imap;
+            c->imap.active = 0;
+            break;
+        default:
+            c->pmap = f->pmap;
+            break;
+        }
+        c->shared = 1;
+        return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Makes the frame being appended, i, visible to the display loop.
+ */
+
+static void publish_frame(FrameTable *t, int i)
+{
+    pthread_mutex_lock(&t->lock);
+    t->count = i + 1;
+    pthread_cond_broadcast(&t->grown);
+    pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ * Checks the frame being appended, i, against the earlier ones, publishing it
+ * straight away if it can share their storage. Returns as reuse_duplicate().
+ */
+
+static int append_duplicate(FrameTable *t, int i, PreparedFrame *p)
+{
+    pthread_mutex_lock(&t->lock);
+    int dup = reuse_duplicate(t, i, p);
+    if (dup == i) {
+        t->count = i + 1;
+        pthread_cond_broadcast(&t->grown);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return dup;
+}
+
+/**
+ * Renders the current gif frame, cropped if requested, for storing as the
+ * given type. Frames that are displayed unscaled are rendered straight into the
+ * screen layout. A frame that repeats the one prepared before it is not laid
+ * out, since it will be merged into it; the table keeps a copy of that frame
+ * to compare with. Makes no X calls.
+ */
+
+static void prepare_frame(gd_GIF *gif, FrameTable *t, int type,
+                          PreparedFrame *p)
+{
+    int x = 0, y = 0, w = gif->width, h = gif->height;
+
+    // Crop by only rendering the requested part of the frame.
+    if (crop_mode) {
+        x = crop_params[0];
+        y = crop_params[1];
+        w = crop_params[2];
+        h = crop_params[3];
+    }
+
+    // Only the animated part of the gif is kept for each frame, over a base
+    // pixmap holding the still part.
+    p->type = type == PIXMAP_FRAME && t->npatch ? PATCH_FRAME : type;
+    p->w = w;
+    p->h = h;
+    p->dup = 0;
+    p->laid_out =
+        p->type != BUFFER_FRAME && p->type != INDEXED_FRAME && !xrender_mode;
+
+    int direct = p->laid_out && frame_fits_screens(w, h);
+    if (direct) {
+        p->pixels = (uint8_t *)malloc(scr->width * scr->height * 4);
+        fill_screen_direct(p->pixels, gif, x, y, w, h);
+        p->hash =
+            hash_pixels(screen_origin(p->pixels, 0), scr->width * 4, w, h);
+    } else {
+        p->pixels = (uint8_t *)malloc(w * h * 4);
+        render_frame(gif, p->pixels, w * 4, x, y, w, h);
+        p->hash = hash_pixels(p->pixels, w * 4, w, h);
+    }
+
+    uint8_t *frame = direct ? screen_origin(p->pixels, 0) : p->pixels;
+    int stride = direct ? scr->width * 4 : w * 4;
+    if (t->last && t->last_hash == p->hash &&
+        same_pixels(t->last, frame, stride, w, h)) {
+        p->dup = 1;
+        free(p->pixels);
+        p->pixels = NULL;
+        return;
+    }
+    if (!t->last)
+        t->last = (uint8_t *)malloc(w * h * 4);
+    for (int row = 0; row < h; row++)
+        memcpy(&t->last[row * w * 4], &frame[row * stride], w * 4);
+    t->last_hash = p->hash;
+
+    if (p->laid_out && !direct) {
+        uint8_t *screen = (uint8_t *)malloc(scr->width * scr->height * 4);
+        fill_screen(screen, p->pixels, w, h);
+        free(p->pixels);
+        p->pixels = screen;
+    }
+}
+
+/**
+ * Appends a prepared frame to the table, uploading it if it is stored as a
+ * pixmap. Returns as append_image_to_table(). Takes the frame's pixels.
+ */
+
+static int store_frame(FrameTable *t, PreparedFrame *p)
+{
+    int i = t->count, dup;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->count == t->size &&
+        resize_frame_table(t, t->size ? t->size * 2 : 16)) {
+        pthread_mutex_unlock(&t->lock);
+        free(p->pixels);
+        return -1;
+    }
+    pthread_mutex_unlock(&t->lock);
+    Frame *c = &t->frames[i];
+    c->type = p->type;
+    c->shared = 0;
+    t->hold[i] = 1;
+    t->hash[i] = p->hash;
+    t->w = p->w;
+    t->h = p->h;
+
+    if ((dup = append_duplicate(t, i, p)) >= 0) {
+        free(p->pixels);
+        return dup;
+    }
+
+    // Store the frame's data, either as a pixmap or a buffer.
+    switch (c->type) {
+    case PATCH_FRAME:
+        c->pmap = generate_patch(t, p->pixels);
+        free(p->pixels);
         break;
     case BUFFER_FRAME:
-        c->bmap = generate_bmap(buffer, gif->width, gif->height);
+        c->bmap = generate_bmap(p->pixels, p->w, p->h);
+        break;
+    case INDEXED_FRAME:
+        c->imap = generate_imap(p->pixels, p->w, p->h);
+        if (c->imap.idx) {
+            free(p->pixels);
+            break;
+        }
+        // Too many colors for a palette, keep the frame as a buffer.
+        c->type = BUFFER_FRAME;
+        c->bmap = generate_bmap(p->pixels, p->w, p->h);
         break;
     default:
-        c->pmap = generate_pmap(buffer, gif->width, gif->height);
-        free(buffer);
+        c->pmap = p->laid_out ? generate_pmap_screen(p->pixels)
+                              : generate_pmap(p->pixels, p->w, p->h);
+        free(p->pixels);
         break;
     }
+    publish_frame(t, i);
 
-    return c;
+    return i;
 }
 
-Frame *load_images_to_list(char *gifpath)
+/**
+ * Renders the current gif frame, cropped if requested, and appends it to the
+ * table, stored as the given type. Returns the index of the frame showing the
+ * image, which is an earlier one if the image repeats the last frame, or -1 if
+ * the table could not grow. Only one thread may append to a table; the frame
+ * is rendered and stored without holding the table's lock, in a slot the
+ * display loop cannot see yet.
+ */
+
+int append_image_to_table(gd_GIF *gif, FrameTable *t, int type)
 {
-    Frame *p = NULL;
-    Frame *c = (Frame *)malloc(sizeof(Frame));
-    Frame *head = c;
-    // Stub out our first entry's neighbors, since it needs to get drawn.
-    c->prev = NULL;
-    c->next = NULL;
+    PreparedFrame p;
+    prepare_frame(gif, t, type, &p);
+    return store_frame(t, &p);
+}
 
-    int w, h;
+/**
+ * Finds the part of the gif that changes at some point of the loop, from the
+ * frame index, without decoding anything. Every frame after the first redraws
+ * its own rectangle, and the one before it if that frame is disposed of; the
+ * rest of the canvas stays as the first frame left it. If that part is at most
+ * half of what is displayed, the screen rectangles it scales to are stored as
+ * the table's patch, so that frames only keep those.
+ */
+
+static void find_animated_area(gd_GIF *gif, FrameTable *t)
+{
+    if (gif->nframes < 2 || xrender_mode)
+        return;
+
+    int x0 = gif->width, y0 = gif->height, x1 = 0, y1 = 0;
+    for (int i = 1; i < gif->nframes; i++) {
+        gd_Frame *f = &gif->frames[i];
+        gd_Frame *p = &gif->frames[i - 1];
+        x0 = MIN(x0, f->fx);
+        y0 = MIN(y0, f->fy);
+        x1 = MAX(x1, f->fx + f->fw);
+        y1 = MAX(y1, f->fy + f->fh);
+        if (p->gce.disposal == 2 || p->gce.disposal == 3) {
+            x0 = MIN(x0, p->fx);
+            y0 = MIN(y0, p->fy);
+            x1 = MAX(x1, p->fx + p->fw);
+            y1 = MAX(y1, p->fy + p->fh);
+        }
+    }
 
+    int x = 0, y = 0, w = gif->width, h = gif->height;
+    if (crop_mode) {
+        x = crop_params[0];
+        y = crop_params[1];
+        w = crop_params[2];
+        h = crop_params[3];
+    }
+    x0 = MAX(x0, x) - x;
+    y0 = MAX(y0, y) - y;
+    x1 = MIN(x1, x + w) - x;
+    y1 = MIN(y1, y + h) - y;
+    if (x0 >= x1 || y0 >= y1 || (x1 - x0) * (y1 - y0) * 2 > w * h)
+        return;
+
+#ifdef HAVE_LIBXINERAMA
+    t->patch = (XRectangle *)malloc(MAX(num_xinerama_screens, 1) *
+                                    sizeof(XRectangle));
+#else
+    t->patch = (XRectangle *)malloc(sizeof(XRectangle));
+#endif /* HAVE_LIBXINERAMA */
+    t->npatch = fill_screen_changed(NULL, NULL, w, h, x0, y0, x1 - x0,
+                                    y1 - y0, t->patch);
+}
+
+/**
+ * Frames are loaded in two stages that overlap. A preparing thread decodes
+ * each frame and lays it out, making no X calls, while the loading thread
+ * uploads the frames in order and publishes them. They meet in a small ring of
+ * prepared frames, which bounds the memory held between the stages.
+ */
+
+#define LOAD_QUEUE_DEPTH 4
+
+typedef struct LoadQueue {
+    gd_GIF *gif;
+    FrameTable *t;
+    uint8_t *hf_pattern;
+    int hf_psize;
+    PreparedFrame ring[LOAD_QUEUE_DEPTH];
+    int head;  // The next frame to be stored.
+    int count; // The number of frames prepared in the ring.
+    int done;  // Set once the preparing thread has prepared every frame.
+    int stop;  // Set if the table cannot take any more frames.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} LoadQueue;
+
+static void *prepare_thread(void *args)
+{
+    LoadQueue *q = (LoadQueue *)args;
+
+    for (int i = 0; gd_get_frame(q->gif) > 0; i++) {
+        // Determine how the frame should be stored.
+        int type = choose_frame_type(q->hf_pattern, q->hf_psize, i);
+
+        pthread_mutex_lock(&q->lock);
+        while (q->count == LOAD_QUEUE_DEPTH && !q->stop)
+            pthread_cond_wait(&q->cond, &q->lock);
+        int tail = (q->head + q->count) % LOAD_QUEUE_DEPTH;
+        int stop = q->stop;
+        pthread_mutex_unlock(&q->lock);
+        if (stop)
+            break;
+
+        // The slot at the tail is not visible to the loading thread yet.
+        PreparedFrame *p = &q->ring[tail];
+        prepare_frame(q->gif, q->t, type, p);
+
+        pthread_mutex_lock(&q->lock);
+        q->count++;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+    pthread_mutex_lock(&q->lock);
+    q->done = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+/**
+ * Appends every frame of the gif to the table, then marks it loaded. Uploads
+ * are only synced with the server once, after the last frame. In verbose mode
+ * the rate of the upload stage is reported.
+ */
+
+static void load_frames(gd_GIF *gif, FrameTable *t)
+{
     // Prepare the hybrid frame variables.
     uint8_t hf_pattern[100] = {0};
     int hf_psize = 0;
     if (hybrid_frame_mode)
         hf_psize = generate_frame_pattern(hf_pattern, hybrid_frame_rate);
 
-    gd_GIF *gif = gd_open_gif(gifpath);
+    // Decompress upcoming frames in parallel; compositing stays in order.
+    if (decode_threads > 1)
+        gd_start_decoders(gif, decode_threads);
+
+    find_animated_area(gif, t);
+
+    // Time spent storing frames, to measure the upload rate by.
+    struct timespec start, end, busy = {0, 0};
+    size_t uploaded = uploaded_bytes();
+
+    LoadQueue q = {gif, t, hf_pattern, hf_psize};
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, prepare_thread, &q)) {
+        // Without a thread, prepare and store each frame in turn.
+        for (int i = 0; gd_get_frame(gif) > 0; i++) {
+            int type = choose_frame_type(hf_pattern, hf_psize, i);
+            if (append_image_to_table(gif, t, type) < 0)
+                break;
+        }
+    } else {
+        pthread_mutex_lock(&q.lock);
+        while (True) {
+            while (!q.count && !q.done)
+                pthread_cond_wait(&q.cond, &q.lock);
+            if (!q.count)
+                break;
+            PreparedFrame p = q.ring[q.head];
+            q.head = (q.head + 1) % LOAD_QUEUE_DEPTH;
+            q.count--;
+            pthread_cond_broadcast(&q.cond);
+            pthread_mutex_unlock(&q.lock);
+
+            int failed = 0;
+            if (q.stop) {
+                free(p.pixels);
+            } else {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                failed = store_frame(t, &p) < 0;
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                busy = time_combine(busy, time_diff(start, end));
+            }
+
+            pthread_mutex_lock(&q.lock);
+            if (failed) {
+                q.stop = 1;
+                pthread_cond_broadcast(&q.cond);
+            }
+        }
+        pthread_mutex_unlock(&q.lock);
+        pthread_join(tid, NULL);
+    }
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.cond);
+    // The gif is only decoded again if the screens change, without the
+    // workers.
+    gd_stop_decoders(gif);
+    // Nothing more is appended to compare with the last frame.
+    free(t->last);
+    t->last = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    XSync(disp, False);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    busy = time_combine(busy, time_diff(start, end));
+    double secs = busy.tv_sec + busy.tv_nsec / 1e9;
+    double mb = (uploaded_bytes() - uploaded) / 1e6;
+    if (verbose_mode && mb > 0 && secs > 0)
+        fprintf(stderr, "Uploaded %d frames, %.1f MB in %.2f s (%.1f MB/s).\n",
+                t->count, mb, secs, mb / secs);
+
+    pthread_mutex_lock(&t->lock);
+    t->loaded = 1;
+    pthread_cond_broadcast(&t->grown);
+    pthread_mutex_unlock(&t->lock);
+}
+
+FrameTable *load_images_to_table(char *gifpath)
+{
+    gd_GIF *gif = open_gif(gifpath);
     if (!gif)
         return NULL;
 
-    for (int i = 0; gd_get_frame(gif); i++) {
-        uint8_t *buffer = (uint8_t *)malloc(gif->width * gif->height * 3);
-        gd_render_frame(gif, buffer);
-        w = gif->width;
-        h = gif->height;
+    // The frame index tells how many frames to make room for.
+    FrameTable *t = new_frame_table(gd_index_frames(gif));
+    if (!t) {
+        gd_close_gif(gif);
+        return NULL;
+    }
 
-        // determine how the frame should be stored
-        if (hybrid_frame_mode) {
-            if (hf_pattern[i % hf_psize]) {
-                c->type = PIXMAP_FRAME;
+    load_frames(gif, t);
+    gd_close_gif(gif);
+
+    if (!t->count) {
+        clean_gif_frames(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+typedef struct LoadJob {
+    gd_GIF *gif;
+    FrameTable *t;
+} LoadJob;
+
+static void *load_thread(void *args)
+{
+    LoadJob *job = (LoadJob *)args;
+
+    // The table keeps the gif.
+    load_frames(job->gif, job->t);
+    free(job);
+
+    return NULL;
+}
+
+/**
+ * Starts loading the gif's frames into a table on a thread of its own, and
+ * returns the table straight away. Its count grows as frames are appended,
+ * signalling grown each time, until loaded is set. Returns NULL if the gif
+ * cannot be opened.
+ */
+
+FrameTable *load_images_in_background(char *gifpath)
+{
+    LoadJob *job = (LoadJob *)malloc(sizeof(LoadJob));
+    pthread_t tid;
+
+    job->gif = open_gif(gifpath);
+    if (!job->gif) {
+        free(job);
+        return NULL;
+    }
+    job->t = new_frame_table(gd_index_frames(job->gif));
+    if (!job->t) {
+        gd_close_gif(job->gif);
+        free(job);
+        return NULL;
+    }
+
+    FrameTable *t = job->t;
+    t->gif = job->gif;
+    if (pthread_create(&tid, NULL, load_thread, job)) {
+        // Without a thread, load the gif before playing it.
+        load_thread(job);
+        return t;
+    }
+    pthread_detach(tid);
+
+    return t;
+}
+
+#ifdef HAVE_LIBXRANDR
+/**
+ * Lays the table's pixmap and patch frames out again for the current screens,
+ * decoding the gif again from memory since the frames do not keep their
+ * pixels. Only the screens that changed from the old layout are scaled and
+ * uploaded; patch tables are laid out again in full, as their base spans every
+ * screen. The replaced pixmaps are stored in stale, and their number returned.
+ */
+
+static int relayout_pixmaps(FrameTable *t, ScreenLayout *old, Pixmap *stale)
+{
+    gd_GIF *gif = t->gif;
+    int nstale = 0, todo = 0;
+
+    for (int i = 0; i < t->count; i++) {
+        Frame *c = &t->frames[i];
+        if (!c->shared && (c->type == PIXMAP_FRAME || c->type == PATCH_FRAME))
+            todo = 1;
+    }
+    if (!todo)
+        return 0;
+
+#ifdef HAVE_LIBXINERAMA
+    uint8_t *kept = (uint8_t *)calloc(MAX(num_xinerama_screens, 1), 1);
+#else
+    uint8_t *kept = (uint8_t *)calloc(1, 1);
+#endif /* HAVE_LIBXINERAMA */
+    if (t->npatch) {
+        if (t->base)
+            stale[nstale++] = t->base;
+        t->base = None;
+        free(t->patch);
+        t->patch = NULL;
+        t->npatch = 0;
+        find_animated_area(gif, t);
+    } else {
+        unchanged_screens(old, kept);
+    }
+
+    int x = 0, y = 0, w = gif->width, h = gif->height;
+    if (crop_mode) {
+        x = crop_params[0];
+        y = crop_params[1];
+        w = crop_params[2];
+        h = crop_params[3];
+    }
+    uint8_t *frame = (uint8_t *)malloc(w * h * 4);
+    uint8_t *screen = NULL;
+    if (t->npatch)
+        screen = (uint8_t *)malloc(scr->width * scr->height * 4);
+
+    // Each frame of the table stands for a run of hold[i] gif frames.
+    gd_seek_frame(gif, 0, NULL);
+    for (int i = 0, k = 0; i < t->count && gd_get_frame(gif) > 0;) {
+        Frame *c = &t->frames[i];
+        if (!k && !c->shared &&
+            (c->type == PIXMAP_FRAME || c->type == PATCH_FRAME)) {
+            render_frame(gif, frame, w * 4, x, y, w, h);
+            stale[nstale++] = c->pmap;
+            if (c->type == PATCH_FRAME && t->npatch) {
+                fill_screen(screen, frame, w, h);
+                c->pmap = generate_patch(t, screen);
             } else {
-                c->type = BUFFER_FRAME;
+                // Patch frames are never kept, so the old pmap goes unused.
+                c->pmap = relayout_pmap(c->pmap, frame, w, h, kept);
+                c->type = PIXMAP_FRAME;
             }
-        } else {
-            c->type = PIXMAP_FRAME;
         }
+        if (++k == t->hold[i]) {
+            i++;
+            k = 0;
+        }
+    }
 
-        // Perform the crop operation, if necessary.
-        if (crop_mode) {
-            uint8_t *cropped;
-            cropped = crop(buffer, gif->width, gif->height, crop_params[0],
-                           crop_params[1], crop_params[2], crop_params[3]);
-            w = crop_params[2];
-            h = crop_params[3];
+    free(frame);
+    free(screen);
+    free(kept);
 
-            free(buffer);
-            buffer = cropped;
-        }
+    return nstale;
+}
 
-        // Store the frame's data, either as a pixmap or a buffer.
-        switch (c->type) {
-        case PIXMAP_FRAME:
-            c->pmap = generate_pmap(buffer, w, h);
-            free(buffer);
-            break;
-        case BUFFER_FRAME:
-            c->bmap = generate_bmap(buffer, w, h);
-            break;
-        default:
-            c->pmap = generate_pmap(buffer, w, h);
-            free(buffer);
-            break;
-        }
+/**
+ * Lays a loaded table out again after the screens changed from old, and shows
+ * frame shown, the one on display, over the new screens. Frames kept as
+ * buffers are laid out whenever they are shown, so only the pixmaps need
+ * redoing.
+ */
 
-        if (i == 0) { // the first frame
-            set_background(c);
-        }
-        c->next = (Frame *)malloc(sizeof(Frame));
-        c->prev = p;
-        p = c;
-        c = c->next;
+void relayout_frames(FrameTable *t, int shown, ScreenLayout *old)
+{
+    // Pixmaps of the old layout, freed once the new one is on display.
+    Pixmap *stale = (Pixmap *)malloc((t->count + 3) * sizeof(Pixmap));
+    int nstale = 0;
+
+    Frame *c = &t->frames[shown];
+    if (c->type == BUFFER_FRAME && c->bmap.active) {
+        c->bmap.active = 0;
+        stale[nstale++] = c->bmap.pmap;
+    } else if (c->type == INDEXED_FRAME && c->imap.active) {
+        c->imap.active = 0;
+        stale[nstale++] = c->imap.pmap;
     }
 
-    if (p != NULL) {
-        free(c);
-        c = p;
+    if (xrender_mode) {
+#ifdef HAVE_LIBXRENDER
+        nstale += xrender_new_targets(&stale[nstale]);
+#endif /* HAVE_LIBXRENDER */
+    } else if (t->gif) {
+        nstale += relayout_pixmaps(t, old, &stale[nstale]);
     }
-    c->next = head;
-    head->prev = c;
-    gd_close_gif(gif);
 
-    return head;
+    set_background(t, shown);
+    for (int i = 0; i < nstale; i++)
+        clear_pmap(stale[i]);
+    free(stale);
 }
+#endif /* HAVE_LIBXRANDR */
@@ -26,13 +26,21 @@ int detect_charging()
     }
 }
 
+/**
+ * Called once per frame by every display loop. Sleeps for as long as the
+ * battery saver holds the animation, reading the root window's events all the
+ * while.
+ */
+
 int check_power_conditions()
 {
     struct timespec w;
     w.tv_sec = 1;
     w.tv_nsec = 0;
 
+    read_root_events();
     while (!((battery_saver && detect_charging()) || !battery_saver)) {
         nanosleep(&w, NULL);
+        read_root_events();
     }
 }
@@ -0,0 +1,225 @@
+#include "gifpaper.h"
+
+/**
+ * Frame flips through the Present extension. Each frame is copied to the root
+ * window on a vertical blank, so it does not tear, and the server reports back
+ * when it reached the screen. Those reports let the display loop make up for
+ * frames that were held back until the next blank, and measure how far frames
+ * land from when they were meant to. The server also reports when it is done
+ * with a pixmap, which must not be drawn into before then.
+ */
+
+#ifdef HAVE_LIBXPRESENT
+// Requests whose completion has not been reported yet, by serial number.
+#define PRESENT_INFLIGHT 16
+// Presented pixmaps the server may still read from.
+#define PRESENT_BUSY 8
+// How long to wait for a pixmap to be let go of. It happens by the next
+// vertical blank, so this only runs out if the event was lost.
+#define PRESENT_IDLE_TIMEOUT_US 100000
+
+static int present_opcode = 0;
+static uint32_t present_serial = 0;
+static uint64_t request_us[PRESENT_INFLIGHT];
+
+// Each busy pixmap, with the serial of its last presentation.
+static Pixmap busy_pmaps[PRESENT_BUSY];
+static uint32_t busy_serials[PRESENT_BUSY];
+static int next_busy = 0;
+
+// The last completed frame, and when the one before it was requested.
+static uint64_t last_msc = 0;
+static uint64_t last_ust = 0;
+static uint64_t last_request_us = 0;
+// Estimated time between vertical blanks, 0 until two frames have completed.
+static uint64_t refresh_us = 0;
+
+// Time frames have spent waiting for a blank since the display loop last
+// asked, beyond the wait of the frame before them.
+static long long pending_delay_us = 0;
+
+// Jitter of the presented frames, against the intervals they were requested
+// at.
+static unsigned long jitter_frames = 0;
+static uint64_t jitter_sum_us = 0;
+static uint64_t jitter_max_us = 0;
+static volatile sig_atomic_t report_requested = 0;
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void request_report(int sig)
+{
+    report_requested = 1;
+}
+
+int init_present(void)
+{
+    int event, error;
+
+    if (!XPresentQueryExtension(disp, &present_opcode, &event, &error))
+        return -1;
+    XPresentSelectInput(disp, root,
+                        PresentCompleteNotifyMask | PresentIdleNotifyMask);
+
+    // kill -USR1 prints the jitter measured so far.
+    signal(SIGUSR1, request_report);
+
+    return 0;
+}
+
+/**
+ * Accounts for a frame that reached the screen. The server's timestamps are
+ * taken from CLOCK_MONOTONIC, like the ones taken here.
+ */
+
+static void frame_completed(XPresentCompleteNotifyEvent *ev)
+{
+    if (ev->kind != PresentCompleteKindPixmap ||
+        present_serial - ev->serial_number >= PRESENT_INFLIGHT)
+        return;
+    uint64_t requested = request_us[ev->serial_number % PRESENT_INFLIGHT];
+
+    if (last_ust && ev->msc > last_msc) {
+        refresh_us = (ev->ust - last_ust) / (ev->msc - last_msc);
+
+        // The frame's delay beyond the last one's stretched the time between
+        // them on screen.
+        long long shown = ev->ust - last_ust;
+        long long meant = requested - last_request_us;
+        long long jitter = llabs(shown - meant);
+        pending_delay_us += shown - meant;
+        jitter_frames++;
+        jitter_sum_us += jitter;
+        if (jitter > jitter_max_us)
+            jitter_max_us = jitter;
+    }
+
+    last_msc = ev->msc;
+    last_ust = ev->ust;
+    last_request_us = requested;
+}
+
+static int busy_slot(Pixmap pmap)
+{
+    for (int i = 0; i < PRESENT_BUSY; i++)
+        if (busy_pmaps[i] == pmap)
+            return i;
+    return -1;
+}
+
+static void mark_busy(Pixmap pmap, uint32_t serial)
+{
+    int i = busy_slot(pmap);
+    if (i < 0) {
+        // When full, the oldest pixmap has long been let go of.
+        i = next_busy;
+        next_busy = (next_busy + 1) % PRESENT_BUSY;
+    }
+    busy_pmaps[i] = pmap;
+    busy_serials[i] = serial;
+}
+
+// A pixmap is free once the server is done with its last presentation.
+static void pixmap_idle(XPresentIdleNotifyEvent *ev)
+{
+    int i = busy_slot(ev->pixmap);
+    if (i >= 0 && busy_serials[i] == ev->serial_number)
+        busy_pmaps[i] = None;
+}
+
+static void read_present_events(void)
+{
+    XEvent ev;
+    while (XCheckTypedEvent(disp, GenericEvent, &ev)) {
+        if (ev.xcookie.extension != present_opcode ||
+            !XGetEventData(disp, &ev.xcookie))
+            continue;
+        if (ev.xcookie.evtype == PresentCompleteNotify)
+            frame_completed((XPresentCompleteNotifyEvent *)ev.xcookie.data);
+        else if (ev.xcookie.evtype == PresentIdleNotify)
+            pixmap_idle((XPresentIdleNotifyEvent *)ev.xcookie.data);
+        XFreeEventData(disp, &ev.xcookie);
+    }
+}
+
+void present_report(void)
+{
+    if (!jitter_frames) {
+        printf("Present: no frames measured yet.\n");
+        return;
+    }
+    printf("Present: %lu frames, mean jitter %.2f ms, max %.2f ms, refresh "
+           "%.2f ms.\n",
+           jitter_frames, jitter_sum_us / 1000.0 / jitter_frames,
+           jitter_max_us / 1000.0, refresh_us / 1000.0);
+}
+
+/**
+ * Presents a pixmap on the root window at the first vertical blank from now.
+ */
+
+void present_pmap(Pixmap pmap)
+{
+    read_present_events();
+    if (report_requested) {
+        report_requested = 0;
+        present_report();
+    }
+
+    uint64_t now = monotonic_us();
+    uint64_t target_msc = 0;
+    if (refresh_us && now > last_ust)
+        target_msc = last_msc + (now - last_ust) / refresh_us + 1;
+
+    present_serial++;
+    request_us[present_serial % PRESENT_INFLIGHT] = now;
+    XPresentPixmap(disp, root, pmap, present_serial, None, None, 0, 0, None,
+                   None, None, PresentOptionNone, target_msc, 0, 0, NULL, 0);
+    mark_busy(pmap, present_serial);
+}
+
+/**
+ * Waits until the server is done with a pixmap that was presented, so that it
+ * can be drawn into again without the change showing on screen half-way.
+ */
+
+void present_wait_idle(Pixmap pmap)
+{
+    uint64_t give_up = monotonic_us() + PRESENT_IDLE_TIMEOUT_US;
+
+    read_present_events();
+    int i;
+    while ((i = busy_slot(pmap)) >= 0) {
+        uint64_t now = monotonic_us();
+        if (now >= give_up) {
+            busy_pmaps[i] = None;
+            break;
+        }
+        // Another thread may read the connection too, so the events are
+        // looked for again every few milliseconds.
+        struct pollfd fd = {ConnectionNumber(disp), POLLIN, 0};
+        int ms = (give_up - now) / 1000 + 1;
+        poll(&fd, 1, ms < 4 ? ms : 4);
+        read_present_events();
+    }
+}
+
+/**
+ * Returns how much later than they were requested, in nanoseconds, frames have
+ * reached the screen since the last call, so the next frame can be sent that
+ * much sooner.
+ */
+
+long long present_take_delay(void)
+{
+    read_present_events();
+    long long delay = pending_delay_us * 1000;
+    pending_delay_us = 0;
+    return delay;
+}
+#endif /* HAVE_LIBXPRESENT */
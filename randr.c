@@ -0,0 +1,118 @@
+#include "gifpaper.h"
+
+/**
+ * Screen hotplug. RandR reports when monitors are plugged in, unplugged or
+ * resized, and the screens are queried again. The frames that were already
+ * loaded are then laid out over the new screens, redoing only the screens
+ * whose geometry changed, rather than loading the gif all over again.
+ */
+
+#ifdef HAVE_LIBXRANDR
+static int randr_event = 0;
+// The size of the root window the screens were last queried for.
+static int screen_w = 0;
+static int screen_h = 0;
+
+int init_randr(void)
+{
+    int error;
+
+    if (!XRRQueryExtension(disp, &randr_event, &error))
+        return -1;
+    XRRSelectInput(disp, root, RRScreenChangeNotifyMask);
+    screen_w = scr->width;
+    screen_h = scr->height;
+
+    return 0;
+}
+
+#ifdef HAVE_LIBXINERAMA
+static int same_geometry(XineramaScreenInfo *a, XineramaScreenInfo *b)
+{
+    return a->x_org == b->x_org && a->y_org == b->y_org &&
+           a->width == b->width && a->height == b->height;
+}
+#endif /* HAVE_LIBXINERAMA */
+
+/**
+ * Reads the screen changes RandR has reported, and queries the screens again if
+ * there were any. Returns 1 if their geometry changed, storing what it was in
+ * old; its screens are the caller's to XFree(). Returns 0 otherwise.
+ */
+
+int screens_changed(ScreenLayout *old)
+{
+    XEvent ev;
+    int changed = 0;
+
+    // The events also update Xlib's idea of the root window's size.
+    while (XCheckTypedEvent(disp, randr_event + RRScreenChangeNotify, &ev)) {
+        XRRUpdateConfiguration(&ev);
+        changed = 1;
+    }
+    if (!changed)
+        return 0;
+
+    old->width = screen_w;
+    old->height = screen_h;
+    screen_w = scr->width;
+    screen_h = scr->height;
+#ifdef HAVE_LIBXINERAMA
+    old->screens = xinerama_screens;
+    old->count = num_xinerama_screens;
+    xinerama_screens = NULL;
+    num_xinerama_screens = 0;
+    init_xinerama();
+#else
+    old->screens = NULL;
+    old->count = 0;
+#endif /* HAVE_LIBXINERAMA */
+
+    if (old->width != scr->width || old->height != scr->height)
+        return 1;
+#ifdef HAVE_LIBXINERAMA
+    if (old->count != num_xinerama_screens)
+        return 1;
+    for (int i = 0; i < num_xinerama_screens; i++) {
+        if (!same_geometry(&old->screens[i], &xinerama_screens[i]))
+            return 1;
+    }
+    if (old->screens)
+        XFree(old->screens);
+#endif /* HAVE_LIBXINERAMA */
+
+    return 0;
+}
+
+/**
+ * Marks in kept the screens whose frames can be copied over from the old
+ * layout: the ones with the same geometry as a screen of old. In extend mode
+ * each screen shows a part of the gif that depends on the size of the whole,
+ * so none are kept if that changed. Returns how many screens are kept.
+ */
+
+int unchanged_screens(ScreenLayout *old, uint8_t *kept)
+{
+    int n = 0;
+
+#ifdef HAVE_LIBXINERAMA
+    for (int i = 0; i < num_xinerama_screens; i++) {
+        kept[i] = 0;
+        if (display_mode == DISPLAY_MODE_EXTEND &&
+            (old->width != scr->width || old->height != scr->height))
+            continue;
+        for (int j = 0; j < old->count; j++) {
+            if (same_geometry(&old->screens[j], &xinerama_screens[i])) {
+                kept[i] = 1;
+                n++;
+                break;
+            }
+        }
+    }
+#else
+    kept[0] = 0;
+#endif /* HAVE_LIBXINERAMA */
+
+    return n;
+}
+#endif /* HAVE_LIBXRANDR */
@@ -42,18 +42,18 @@ int display_as_slideshow(char *dirpath, long framerate, long sliderate)
         return 0;
     }
 
-    Frame *c = NULL;   // The gif which is actively being displayed.
-    Frame *n = NULL;   // The next gif to be displayed, which we are preparing.
-    Frame *n_head;     // The head frame of the next gif to be displayed.
-    Frame *n_p = NULL; // The prior frame that was prepared for the next gif.
+    FrameTable *c = NULL; // The gif which is actively being displayed.
+    int c_idx = 0;        // The frame of it which is on display.
+    int held = 0;         // Frame periods the current frame has been shown.
+    FrameTable *n = NULL; // The next gif to be displayed, being prepared.
     gd_GIF *n_hdl = NULL; // Handle to the gif object of the next gif.
     int n_idx;            // Index of the frame in the next gif.
-    Frame *p = NULL;      // The last gif that was displayed in the slideshow.
+    FrameTable *p = NULL; // The last gif that was displayed in the slideshow.
 
     // Prepare the first gif to be displayed upfront.
     SlideshowEntry *gif_head = gif;
     while (1) {
-        c = load_images_to_list(gif->path);
+        c = load_images_to_table(gif->path);
         gif = gif->next;
         if (c)
             break;
@@ -97,35 +97,22 @@ int display_as_slideshow(char *dirpath, long framerate, long sliderate)
             while (gd_get_frame(n_hdl) > 0) {
 
                 // Determine how the frame should be stored.
-                if (hybrid_frame_mode) {
-                    if (hf_pattern[n_idx % hf_psize]) {
-                        n->type = PIXMAP_FRAME;
-                    } else {
-                        n->type = BUFFER_FRAME;
-                    }
-                } else {
-                    n->type = PIXMAP_FRAME;
-                }
-
-                append_image_to_list(n_hdl, n);
+                int type = choose_frame_type(hf_pattern, hf_psize, n_idx);
 
-                n->next = (Frame *)malloc(sizeof(Frame));
-                n->prev = n_p;
-                n_p = n;
-                n = n->next;
+                if (append_image_to_table(n_hdl, n, type) < 0)
+                    break;
                 n_idx += 1;
             }
 
-            if (n_p) {
-                free(n);
-                n = n_p;
+            // Swap out the gifs, unless the next one had nothing to show.
+            if (n->count) {
+                p = c;
+                c = n;
+                c_idx = 0;
+                held = 0;
+            } else {
+                clean_gif_frames(n);
             }
-            n->next = n_head;
-            n_head->prev = n;
-
-            // Swap out the gifs.
-            p = c;
-            c = n_head;
             n = NULL;
             gif = gif->next;
 
@@ -135,15 +122,20 @@ int display_as_slideshow(char *dirpath, long framerate, long sliderate)
         }
         pthread_mutex_unlock(&timer_lock);
 
-        // Set the background to the next frame of the
-        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+        // Set the background to the next frame of the gif. Decoding and
+        // scaling may run on other threads, so time by the wall clock.
+        clock_gettime(CLOCK_MONOTONIC, &start);
         check_power_conditions();
-        _set_background(c, p);
+        if (!held)
+            set_background(c, c_idx);
         if (p) {
             clean_gif_frames(p);
             p = NULL;
         }
-        c = c->next;
+        if (++held >= c->hold[c_idx]) {
+            c_idx = NEXT_FRAME(c, c_idx);
+            held = 0;
+        }
 
         if (!n) {
             if (n_hdl)
@@ -155,45 +147,34 @@ int display_as_slideshow(char *dirpath, long framerate, long sliderate)
                     printf("Warning: gif at %s was not readable.\n", gif->path);
                 gif = gif->next;
             }
+            if (decode_threads > 1)
+                gd_start_decoders(n_hdl, decode_threads);
 
-            n = (Frame *)malloc(sizeof(Frame));
-            n_head = n;
+            n = new_frame_table(gd_index_frames(n_hdl));
             n_idx = 0;
 
-            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+            clock_gettime(CLOCK_MONOTONIC, &end);
         } else {
-            // Write frames to the circular list
+            // Write frames to the frame table
             while (gd_get_frame(n_hdl) > 0) {
-                clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &load_start);
+                clock_gettime(CLOCK_MONOTONIC, &load_start);
 
                 // Determine how the frame should be stored.
-                if (hybrid_frame_mode) {
-                    if (hf_pattern[n_idx % hf_psize]) {
-                        n->type = PIXMAP_FRAME;
-                    } else {
-                        n->type = BUFFER_FRAME;
-                    }
-                } else {
-                    n->type = PIXMAP_FRAME;
-                }
+                int type = choose_frame_type(hf_pattern, hf_psize, n_idx);
 
-                append_image_to_list(n_hdl, n);
-
-                n->next = (Frame *)malloc(sizeof(Frame));
-                n->prev = n_p;
-                n_p = n;
-                n = n->next;
+                if (append_image_to_table(n_hdl, n, type) < 0)
+                    break;
                 n_idx += 1;
 
                 // Make a projection to see if we have enough time for another
                 // frame.
-                clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+                clock_gettime(CLOCK_MONOTONIC, &end);
                 proj = generate_load_projection(start, load_start, end);
                 if (proj.tv_sec > 0 || proj.tv_nsec >= w_frame.tv_nsec) {
                     break;
                 }
             }
-            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+            clock_gettime(CLOCK_MONOTONIC, &end);
         }
 
         diff = time_diff(start, end);
@@ -1,5 +1,9 @@
 #include "gifpaper.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 int generate_frame_pattern(uint8_t *buf, float f_rate)
 {
     int rate = (int)(f_rate * 100.0);
@@ -31,4 +35,181 @@ void _generate_frame_pattern(uint8_t *buf, int buf_size, int count)
                             count / 2);
 }
 
+/**
+ * Picks how frame idx of a gif should be stored, following the hybrid frame
+ * pattern when one is in use.
+ */
+
+int choose_frame_type(uint8_t *pattern, int pattern_size, int idx)
+{
+    if (!hybrid_frame_mode || pattern[idx % pattern_size])
+        return PIXMAP_FRAME;
+    return indexed_frame_mode ? INDEXED_FRAME : BUFFER_FRAME;
+}
+
+/**
+ * Converts a frame of 32-bit pixels into 8-bit indices into a palette of its
+ * distinct pixels. GIF frames use at most 256 colors, but a composited frame
+ * can mix several local color tables; such frames get a NULL idx, and should
+ * be kept as buffers instead.
+ */
+
+Indexmap generate_imap(uint8_t *buffer, int w, int h)
+{
+    Indexmap ret = {0};
+    uint32_t *pixels = (uint32_t *)buffer;
+    uint32_t palette[256];
+    // Open addressing hash table from pixel to palette index + 1.
+    uint32_t keys[512];
+    uint16_t slots[512] = {0};
+    int ncolors = 0;
+
+    ret.w = w;
+    ret.h = h;
+    ret.idx = (uint8_t *)malloc(w * h);
+    if (!ret.idx)
+        return ret;
+
+    for (int i = 0; i < w * h; i++) {
+        uint32_t p = pixels[i];
+        // Runs of one color are common, skip the lookup for them.
+        if (i && p == pixels[i - 1]) {
+            ret.idx[i] = ret.idx[i - 1];
+            continue;
+        }
+        int k = (p * 2654435761u) >> 23;
+        while (slots[k] && keys[k] != p)
+            k = (k + 1) & 511;
+        if (!slots[k]) {
+            if (ncolors == 256) {
+                free(ret.idx);
+                ret.idx = NULL;
+                return ret;
+            }
+            keys[k] = p;
+            palette[ncolors] = p;
+            slots[k] = ++ncolors;
+        }
+        ret.idx[i] = slots[k] - 1;
+    }
+
+    ret.palette = (uint32_t *)malloc(ncolors * sizeof(uint32_t));
+    if (!ret.palette) {
+        free(ret.idx);
+        ret.idx = NULL;
+        return ret;
+    }
+    memcpy(ret.palette, palette, ncolors * sizeof(uint32_t));
+    ret.ncolors = ncolors;
+
+    return ret;
+}
+
+static void expand_indices(uint32_t *dst, const uint8_t *idx,
+                           const uint32_t *palette, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        dst[i + 0] = palette[idx[i + 0]];
+        dst[i + 1] = palette[idx[i + 1]];
+        dst[i + 2] = palette[idx[i + 2]];
+        dst[i + 3] = palette[idx[i + 3]];
+    }
+    for (; i < n; i++)
+        dst[i] = palette[idx[i]];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static void
+expand_indices_avx2(uint32_t *dst, const uint8_t *idx, const uint32_t *palette,
+                    int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *)&idx[i]));
+        _mm256_storeu_si256((__m256i *)&dst[i],
+                            _mm256_i32gather_epi32((const int *)palette, v, 4));
+    }
+    expand_indices(&dst[i], &idx[i], palette, n - i);
+}
+#endif
+
+/**
+ * Expands an indexed frame back into a freshly malloc'd buffer of 32-bit
+ * pixels, ready to be scaled. Uses AVX2 gathers when the CPU has them.
+ */
+
+uint8_t *expand_imap(Indexmap *imap)
+{
+    static void (*expand)(uint32_t *, const uint8_t *, const uint32_t *, int);
+    uint32_t *buffer = (uint32_t *)malloc(imap->w * imap->h * 4);
+    if (!buffer)
+        return NULL;
+
+    if (!expand) {
+        expand = expand_indices;
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2"))
+            expand = expand_indices_avx2;
+#endif
+    }
+    expand(buffer, imap->idx, imap->palette, imap->w * imap->h);
+
+    return (uint8_t *)buffer;
+}
+
+/**
+ * Returns a buffer frame as 32-bit pixels. Packed frames are expanded into a
+ * new buffer, to be freed by the caller; others are returned as they are.
+ */
+
+uint8_t *expand_bmap(Buffmap *bmap)
+{
+    if (bmap->bpp == 4)
+        return bmap->buf;
+
+    size_t n = (size_t)bmap->w * bmap->h;
+    uint32_t *buffer = (uint32_t *)malloc(n * 4);
+    if (!buffer)
+        return NULL;
+    const uint8_t *src = bmap->buf;
+    for (size_t i = 0; i < n; i++)
+        buffer[i] = src[i * 3] | src[i * 3 + 1] << 8 |
+                    (uint32_t)src[i * 3 + 2] << 16;
+
+    return (uint8_t *)buffer;
+}
+
+/**
+ * Hashes a w x h block of 32-bit pixels whose rows are stride bytes apart.
+ * Four independent lanes per row keep the multiplies from serializing.
+ */
+
+uint64_t hash_pixels(const uint8_t *buf, int stride, int w, int h)
+{
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = k ^ ((uint64_t)w << 32 | h);
+
+    for (int y = 0; y < h; y++) {
+        const uint32_t *row = (const uint32_t *)&buf[y * stride];
+        uint64_t a = hash, b = hash + 1, c = hash + 2, d = hash + 3;
+        int x = 0;
+        for (; x + 4 <= w; x += 4) {
+            a = (a ^ row[x + 0]) * k;
+            b = (b ^ row[x + 1]) * k;
+            c = (c ^ row[x + 2]) * k;
+            d = (d ^ row[x + 3]) * k;
+        }
+        for (; x < w; x++)
+            a = (a ^ row[x]) * k;
+        hash = (a ^ (b << 17 | b >> 47) ^ (c << 31 | c >> 33) ^
+                (d << 47 | d >> 17)) *
+               k;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
 // q-tree code will live here.
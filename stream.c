@@ -0,0 +1,139 @@
+#include "gifpaper.h"
+
+/**
+ * Streaming mode. Instead of loading every frame up front, a decoder thread
+ * runs through the gif over and over, rendering each frame for display into a
+ * small ring of screen buffers, while the presentation loop only uploads and
+ * shows them. Memory use depends on the ring depth, not on the gif's length,
+ * at the cost of decoding continuously.
+ */
+
+typedef struct Stream {
+    gd_GIF *gif;
+    uint8_t **ring;
+    int depth;
+    int head;  // The next frame to be presented.
+    int count; // The number of frames ready in the ring.
+    int done;  // Set if the decoder gave up, i.e. no frame is readable.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Stream;
+
+void *stream_decoder_thread(void *args)
+{
+    Stream *s = (Stream *)args;
+    int tail = 0;
+    int loop_frames = 0;
+
+    while (True) {
+        if (gd_get_frame(s->gif) <= 0) {
+            // Start over at the trailer, unless the gif has nothing to show.
+            if (!loop_frames)
+                break;
+            gd_rewind(s->gif);
+            loop_frames = 0;
+            continue;
+        }
+        loop_frames++;
+
+        pthread_mutex_lock(&s->lock);
+        while (s->count == s->depth)
+            pthread_cond_wait(&s->cond, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+
+        // The slot at the tail is not visible to the presentation loop yet.
+        render_frame_to_screen(s->gif, s->ring[tail]);
+        tail = (tail + 1) % s->depth;
+
+        pthread_mutex_lock(&s->lock);
+        s->count++;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->done = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+int display_as_stream(char *gifpath, long framerate)
+{
+    Stream s = {0};
+    s.gif = open_gif(gifpath);
+    if (!s.gif) {
+        printf("Error: the gif was not readable.\n");
+        return -1;
+    }
+    if (decode_threads > 1)
+        gd_start_decoders(s.gif, decode_threads);
+
+    s.depth = stream_depth;
+    s.ring = (uint8_t **)malloc(s.depth * sizeof(uint8_t *));
+    for (int i = 0; i < s.depth; i++)
+        s.ring[i] = (uint8_t *)malloc(scr->width * scr->height * 4);
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    // Frames are shown from two pixmaps in turn, so that the one being
+    // updated is never on display.
+    FrameTable *frames = new_frame_table(2);
+    for (int i = 0; i < 2; i++) {
+        frames->frames[i].type = PIXMAP_FRAME;
+        frames->frames[i].pmap = new_pixmap(scr->width, scr->height);
+        frames->frames[i].shared = 0;
+        frames->hold[i] = 1;
+    }
+    frames->count = 2;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, stream_decoder_thread, &s);
+
+    // The decoder thread adds to the process' CPU time, so frames are timed
+    // by the wall clock here.
+    struct timespec start, end, diff;
+    struct timespec w_frame, w_actual;
+    w_frame.tv_sec = 0;
+    w_frame.tv_nsec = 999999999 / framerate; // 1 second divided by frame rate
+
+    for (int i = 0;; i = !i) {
+        check_power_conditions();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pthread_mutex_lock(&s.lock);
+        while (!s.count && !s.done)
+            pthread_cond_wait(&s.cond, &s.lock);
+        pthread_mutex_unlock(&s.lock);
+        if (!s.count) {
+            printf("Error: the gif has no readable frames.\n");
+            return -1;
+        }
+
+#ifdef HAVE_LIBXPRESENT
+        // The pixmap may still be on its way to the screen.
+        if (present_mode)
+            present_wait_idle(frames->frames[i].pmap);
+#endif /* HAVE_LIBXPRESENT */
+        _generate_pmap(frames->frames[i].pmap, s.ring[s.head], 0, 0,
+                       scr->width, scr->height);
+        set_background(frames, i);
+
+        pthread_mutex_lock(&s.lock);
+        s.head = (s.head + 1) % s.depth;
+        s.count--;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        diff = time_diff(start, end);
+        if (diff.tv_sec > 0 || diff.tv_nsec >= w_frame.tv_nsec) {
+            printf("Timing failure! Expect a choppy frame...\n");
+        } else {
+            w_actual.tv_sec = 0;
+            w_actual.tv_nsec = w_frame.tv_nsec - diff.tv_nsec;
+            nanosleep(&w_actual, NULL);
+        }
+    }
+}
@@ -31,9 +31,72 @@ int depth;
 XContext xid_context = 0;
 Window root = 0;
 
+#ifdef HAVE_LIBXEXT
+/**
+ * Shared memory segments for uploading images with MIT-SHM, so that their
+ * pixels do not have to be copied over the X connection. Segments are reused
+ * round robin for images of any size that fits them, and only grow, in powers
+ * of two, when one does not. The server may still be reading from a segment
+ * after XShmPutImage() returns, so one is only written to again after an
+ * XSync(). Images smaller than SHM_MIN_BYTES, such as damage rectangles, are
+ * cheaper to send with XPutImage() than to sync on.
+ */
+
+#define SHM_POOL_SIZE 4
+#define SHM_MIN_BYTES (64 * 1024)
+
+typedef struct ShmSegment {
+    XShmSegmentInfo info;
+    size_t size;
+    int pending; // Set if an upload from the segment may not have finished.
+} ShmSegment;
+
+static ShmSegment shm_pool[SHM_POOL_SIZE];
+static int shm_next = 0;
+static int shm_available = 0;
+static int shm_error = 0;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* HAVE_LIBXEXT */
+
+// Root window properties that point to the wallpaper, interned once.
+static Atom prop_root = None;
+static Atom prop_esetroot = None;
+// Shared by every upload, none of them changes it.
+static GC upload_gc;
+// Header for XPutImage() uploads, pointed at each caller's buffer in turn.
+static XImage *put_img = NULL;
+static pthread_mutex_t put_lock = PTHREAD_MUTEX_INITIALIZER;
+// XPutImage() uploads are sent in requests of at most this many bytes, well
+// under the server's limit, so that the server can start on an image while the
+// rest of it is still being written.
+#define PUT_CHUNK_BYTES (256 * 1024)
+static long put_chunk_bytes = PUT_CHUNK_BYTES;
+// Bytes of pixels uploaded by the calling thread.
+static __thread size_t uploaded = 0;
+
+// Set when another client may have changed the wallpaper since it was last
+// checked. Starts set, so that the wallpaper found at startup is checked.
+static int root_changed = 1;
+// Changes we made to the wallpaper property whose events are still to come.
+static int own_root_changes = 0;
+// The pixmap last set as the wallpaper.
+static Pixmap background = None;
+
+/**
+ * XIDs of the pixmaps this process has created and not freed yet, so that the
+ * wallpaper's owner can be found without asking the server or going through
+ * the frames. An open addressing table kept at most half full.
+ */
+
+static Pixmap *pixmap_set = NULL;
+static int pixmap_set_size = 0;
+static int pixmap_set_count = 0;
+static pthread_mutex_t pixmap_set_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void init_x(void)
 {
-    // XInitThreads(); // must always be the first call
+    // Frames may be uploaded by a loader thread while others are displayed.
+    XInitThreads(); // must always be the first call
     disp = XOpenDisplay(NULL);
     if (!disp)
         return;
@@ -44,6 +107,22 @@ void init_x(void)
     root = RootWindow(disp, DefaultScreen(disp));
     scr = ScreenOfDisplay(disp, DefaultScreen(disp));
     xid_context = XUniqueContext();
+#ifdef HAVE_LIBXEXT
+    shm_available = XShmQueryExtension(disp);
+#endif /* HAVE_LIBXEXT */
+
+    /* This will locate the properties, creating them if they don't exist */
+    prop_root = XInternAtom(disp, "_XROOTPMAP_ID", False);
+    prop_esetroot = XInternAtom(disp, "ESETROOT_PMAP_ID", False);
+    upload_gc = XCreateGC(disp, root, 0, 0);
+    // Leave room for the request's header. BIG-REQUESTS raises the limit.
+    long max_request = XExtendedMaxRequestSize(disp);
+    if (!max_request)
+        max_request = XMaxRequestSize(disp);
+    if (max_request * 4 - 64 < put_chunk_bytes)
+        put_chunk_bytes = max_request * 4 - 64;
+    // Changes to the wallpaper come in as events, rather than being polled.
+    XSelectInput(disp, root, PropertyChangeMask);
 
     return;
 }
@@ -81,18 +160,47 @@ void init_xinerama(void)
 }
 #endif /* HAVE_LIBXINERAMA */
 
+/**
+ * Keeps a frame of 32-bit pixels as a buffer, taking it over. Unless the
+ * visual uses the top byte of a pixel, it is packed in place to 3 bytes per
+ * pixel; expand_bmap() restores it when the frame is shown.
+ */
+
 Buffmap generate_bmap(uint8_t *buffer, int srcW, int srcH)
 {
     Buffmap ret;
     ret.buf = buffer;
+    ret.bpp = 4;
     ret.w = srcW;
     ret.h = srcH;
 
+    if ((vis->red_mask | vis->green_mask | vis->blue_mask) & 0xff000000)
+        return ret;
+
+    // Each packed pixel lands at or before where it was read from.
+    const uint32_t *pixels = (const uint32_t *)buffer;
+    size_t n = (size_t)srcW * srcH;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t v = pixels[i];
+        buffer[i * 3] = v;
+        buffer[i * 3 + 1] = v >> 8;
+        buffer[i * 3 + 2] = v >> 16;
+    }
+    uint8_t *packed = (uint8_t *)realloc(buffer, n * 3);
+    ret.buf = packed ? packed : buffer;
+    ret.bpp = 3;
+
     return ret;
 }
 
 Pixmap generate_pmap(uint8_t *buffer, int srcW, int srcH)
 {
+    // The server scales the frame when it is shown, keep it at its own size.
+    if (xrender_mode) {
+        Pixmap pmap = new_pixmap(srcW, srcH);
+        return _generate_pmap(pmap, buffer, 0, 0, srcW, srcH);
+    }
+
     switch (display_mode) {
     case DISPLAY_MODE_REPLICATE:
         return generate_pmap_replicate(buffer, srcW, srcH);
@@ -106,75 +214,575 @@ Pixmap generate_pmap(uint8_t *buffer, int srcW, int srcH)
 Pixmap generate_pmap_replicate(uint8_t *buffer, int srcW, int srcH)
 {
     Pixmap pmap;
-    pmap = XCreatePixmap(disp, root, scr->width, scr->height, depth);
+    pmap = new_pixmap(scr->width, scr->height);
+
+    uint8_t *scaled = (uint8_t *)malloc(scr->width * scr->height * 4);
+
+    fill_screen_replicate(scaled, buffer, srcW, srcH);
+
+    _generate_pmap(pmap, scaled, 0, 0, scr->width, scr->height);
+
+    free(scaled);
+
+    return pmap;
+}
+
+Pixmap generate_pmap_extend(uint8_t *buffer, int srcW, int srcH)
+{
+    Pixmap pmap;
+    pmap = new_pixmap(scr->width, scr->height);
 
     uint8_t *scaled = (uint8_t *)malloc(scr->width * scr->height * 4);
 
+    fill_screen_extend(scaled, buffer, srcW, srcH);
+
+    _generate_pmap(pmap, scaled, 0, 0, scr->width, scr->height);
+
+    free(scaled);
+
+    return pmap;
+}
+
+/**
+ * Generates a pixmap from a buffer that is already laid out over the screens.
+ */
+
+Pixmap generate_pmap_screen(uint8_t *screen)
+{
+    Pixmap pmap;
+    pmap = new_pixmap(scr->width, scr->height);
+
+    _generate_pmap(pmap, screen, 0, 0, scr->width, scr->height);
+
+    return pmap;
+}
+
+#ifdef HAVE_LIBXRANDR
+/**
+ * Lays a frame out again after the screens changed. The screens marked in kept
+ * look the same as before, and are copied over from the old pixmap on the
+ * server; only the others are scaled from the srcW x srcH frame and uploaded,
+ * each on its own. Returns the new pixmap, the old one is left to the caller.
+ */
+
+Pixmap relayout_pmap(Pixmap old, uint8_t *buffer, int srcW, int srcH,
+                     const uint8_t *kept)
+{
+    Pixmap pmap = new_pixmap(scr->width, scr->height);
+
 #ifdef HAVE_LIBXINERAMA
     for (int i = 0; i < num_xinerama_screens; i++) {
-        scaled = scale_to_screen(scaled, buffer, srcW, 0, 0, srcW, srcH, i);
+        XineramaScreenInfo *s = &xinerama_screens[i];
+        if (kept[i]) {
+            XCopyArea(disp, old, pmap, upload_gc, s->x_org, s->y_org, s->width,
+                      s->height, s->x_org, s->y_org);
+            continue;
+        }
+
+        int x = 0, y = 0, w = srcW, h = srcH;
+        if (display_mode == DISPLAY_MODE_EXTEND &&
+            !extend_source_rect(i, srcW, srcH, &x, &y, &w, &h))
+            continue;
+        uint8_t *part = (uint8_t *)malloc(s->width * s->height * 4);
+        scale(part, s->width, 0, 0, s->width, s->height, buffer, srcW, x, y, w,
+              h);
+        _generate_pmap(pmap, part, s->x_org, s->y_org, s->width, s->height);
+        free(part);
     }
 #else
-    scaled = scale_to_screen(scaled, buffer, srcW, 0, 0, srcW, srcH, 0);
+    uint8_t *screen = (uint8_t *)malloc(scr->width * scr->height * 4);
+    fill_screen(screen, buffer, srcW, srcH);
+    _generate_pmap(pmap, screen, 0, 0, scr->width, scr->height);
+    free(screen);
 #endif /* HAVE_LIBXINERAMA */
 
-    _generate_pmap(pmap, scaled, 0, 0, scr->width, scr->height);
+    return pmap;
+}
+#endif /* HAVE_LIBXRANDR */
+
+/**
+ * Generates a patch frame's pixmap from a buffer laid out over the screens. The
+ * table's patch rectangles are stacked in it one above the other. The first
+ * patch of a table also uploads the whole buffer as its base, since the still
+ * part is the same in every frame.
+ */
+
+Pixmap generate_patch(FrameTable *t, uint8_t *screen)
+{
+    int w = 0, h = 0;
+    for (int i = 0; i < t->npatch; i++) {
+        w = MAX(w, t->patch[i].width);
+        h += t->patch[i].height;
+    }
+
+    uint8_t *part = (uint8_t *)calloc(w * h, 4);
+    for (int i = 0, y = 0; i < t->npatch; i++) {
+        XRectangle *r = &t->patch[i];
+        for (int row = 0; row < r->height; row++, y++)
+            memcpy(&part[y * w * 4],
+                   &screen[((r->y + row) * scr->width + r->x) * 4],
+                   r->width * 4);
+    }
+    Pixmap pmap = _generate_pmap(new_pixmap(w, h), part, 0, 0, w, h);
+    free(part);
+
+    if (!t->base)
+        t->base = generate_pmap_screen(screen);
 
     return pmap;
 }
 
-Pixmap generate_pmap_extend(uint8_t *buffer, int srcW, int srcH)
+/**
+ * Draws a patch frame by copying its rectangles into the table's base pixmap.
+ * If the base is the wallpaper already, only those rectangles are redrawn.
+ */
+
+static int draw_patch_to_background(FrameTable *t, Pixmap patch)
 {
-    Pixmap pmap;
-    pmap = XCreatePixmap(disp, root, scr->width, scr->height, depth);
+    for (int i = 0, y = 0; i < t->npatch; i++) {
+        XRectangle *r = &t->patch[i];
+        XCopyArea(disp, patch, t->base, upload_gc, 0, y, r->width, r->height,
+                  r->x, r->y);
+        y += r->height;
+    }
+
+    if (check_root_owner() || background != t->base)
+        return draw_pmap_to_background(t->base);
+
+    for (int i = 0; i < t->npatch; i++)
+        XClearArea(disp, root, t->patch[i].x, t->patch[i].y,
+                   t->patch[i].width, t->patch[i].height, False);
+    XFlush(disp);
+
+    return 0;
+}
+
+/**
+ * Returns where screen i starts in a screen-sized buffer.
+ */
+
+uint8_t *screen_origin(uint8_t *screen, int i)
+{
+#ifdef HAVE_LIBXINERAMA
+    if (i < num_xinerama_screens)
+        return &screen[(xinerama_screens[i].y_org * scr->width +
+                        xinerama_screens[i].x_org) *
+                       4];
+#endif /* HAVE_LIBXINERAMA */
+    return screen;
+}
+
+#ifdef HAVE_LIBXINERAMA
+/**
+ * Returns the first screen with the same size as screen i, possibly i itself.
+ */
+
+static int first_screen_of_size(int i)
+{
+    int j = 0;
+    while (xinerama_screens[j].width != xinerama_screens[i].width ||
+           xinerama_screens[j].height != xinerama_screens[i].height)
+        j++;
+    return j;
+}
+
+/**
+ * Copies what was laid out for screen from onto screen to, which has the same
+ * size.
+ */
+
+static void copy_screen(uint8_t *screen, int from, int to)
+{
+    int stride = scr->width * 4;
+    uint8_t *src = screen_origin(screen, from);
+    uint8_t *dst = screen_origin(screen, to);
+
+    for (int y = 0; y < xinerama_screens[to].height; y++)
+        memcpy(&dst[y * stride], &src[y * stride],
+               xinerama_screens[to].width * 4);
+}
+#endif /* HAVE_LIBXINERAMA */
+
+/**
+ * The fill_screen functions lay a frame of 32-bit pixels out over a
+ * screen-sized buffer, according to the display mode. They make no X calls,
+ * so they can run off the main thread.
+ */
 
-    int im_w, im_h;
-    im_w = srcW;
-    im_h = srcH;
+void fill_screen(uint8_t *screen, uint8_t *buffer, int srcW, int srcH)
+{
+    switch (display_mode) {
+    case DISPLAY_MODE_REPLICATE:
+        fill_screen_replicate(screen, buffer, srcW, srcH);
+        break;
+    case DISPLAY_MODE_EXTEND:
+        fill_screen_extend(screen, buffer, srcW, srcH);
+        break;
+    default:
+        fill_screen_replicate(screen, buffer, srcW, srcH);
+        break;
+    }
+}
+
+void fill_screen_replicate(uint8_t *screen, uint8_t *buffer, int srcW,
+                           int srcH)
+{
+#ifdef HAVE_LIBXINERAMA
+    for (int i = 0; i < num_xinerama_screens; i++) {
+        // Screens of a size already scaled to get a copy of that screen.
+        int j = first_screen_of_size(i);
+        if (j < i)
+            copy_screen(screen, j, i);
+        else
+            scale_to_screen(screen, buffer, srcW, 0, 0, srcW, srcH, i);
+    }
+#else
+    scale_to_screen(screen, buffer, srcW, 0, 0, srcW, srcH, 0);
+#endif /* HAVE_LIBXINERAMA */
+}
+
+/**
+ * Finds the part of a srcW x srcH frame that extend mode shows on screen i,
+ * kept inside the frame for gifs whose aspect ratio does not match the
+ * screens'. Returns 0 if nothing of the frame lands on the screen.
+ */
+
+int extend_source_rect(int i, int srcW, int srcH, int *x, int *y, int *w,
+                       int *h)
+{
     double scale = scr->width > scr->height
-                       ? ((double)im_w) / ((double)scr->width)
-                       : ((double)im_h) / ((double)scr->height);
+                       ? ((double)srcW) / ((double)scr->width)
+                       : ((double)srcH) / ((double)scr->height);
+    int diff_x, diff_y;
+    diff_x = srcW - ((double)scr->width * scale);
+    diff_y = srcH - ((double)scr->height * scale);
+
+    *x = ((double)xinerama_screens[i].x_org * scale) + diff_x;
+    *y = ((double)xinerama_screens[i].y_org * scale) + diff_y;
+    *w = ((double)xinerama_screens[i].width * scale);
+    *h = ((double)xinerama_screens[i].height * scale);
+
+    if (*x < 0)
+        *x = 0;
+    if (*y < 0)
+        *y = 0;
+    if (*x + *w > srcW)
+        *w = srcW - *x;
+    if (*y + *h > srcH)
+        *h = srcH - *y;
+
+    return *w > 0 && *h > 0;
+}
 
-    uint8_t *scaled = (uint8_t *)malloc(scr->width * scr->height * 4);
+void fill_screen_extend(uint8_t *screen, uint8_t *buffer, int srcW, int srcH)
+{
+    for (int i = 0; i < num_xinerama_screens; i++) {
+        int sub_x, sub_y, sub_w, sub_h;
+        if (!extend_source_rect(i, srcW, srcH, &sub_x, &sub_y, &sub_w, &sub_h))
+            continue;
+
+        // Scale straight out of the frame, without copying the part out.
+        scale_to_screen(screen, buffer, srcW, sub_x, sub_y, sub_w, sub_h, i);
+    }
+}
+
+/**
+ * Lays out again only what depends on the (x, y, w, h) part of a srcW x srcH
+ * frame, over a screen buffer that holds the frame as it was before that part
+ * changed. Stores the rectangle of the buffer redrawn on each screen in rects,
+ * and returns how many there are. With a NULL screen, the rectangles are only
+ * found.
+ */
 
+int fill_screen_changed(uint8_t *screen, uint8_t *buffer, int srcW, int srcH,
+                        int x, int y, int w, int h, XRectangle *rects)
+{
+    int n = 0;
+#ifdef HAVE_LIBXINERAMA
     for (int i = 0; i < num_xinerama_screens; i++) {
-        int diff_x, diff_y;
-        diff_x = im_w - ((double)scr->width * scale);
-        diff_y = im_h - ((double)scr->height * scale);
+        int sub_x = 0, sub_y = 0, sub_w = srcW, sub_h = srcH;
+        if (display_mode == DISPLAY_MODE_EXTEND &&
+            !extend_source_rect(i, srcW, srcH, &sub_x, &sub_y, &sub_w, &sub_h))
+            continue;
+        n += scale_changed(screen, scr->width, xinerama_screens[i].x_org,
+                           xinerama_screens[i].y_org, xinerama_screens[i].width,
+                           xinerama_screens[i].height, buffer, srcW, sub_x,
+                           sub_y, sub_w, sub_h, x - sub_x, y - sub_y, w, h,
+                           &rects[n]);
+    }
+#else
+    n += scale_changed(screen, scr->width, 0, 0, scr->width, scr->height,
+                       buffer, srcW, 0, 0, srcW, srcH, x, y, w, h, &rects[n]);
+#endif /* HAVE_LIBXINERAMA */
 
-        int sub_x, sub_y, sub_w, sub_h = 0;
-        sub_x = ((double)xinerama_screens[i].x_org * scale) + diff_x;
-        sub_y = ((double)xinerama_screens[i].y_org * scale) + diff_y;
-        sub_w = ((double)xinerama_screens[i].width * scale);
-        sub_h = ((double)xinerama_screens[i].height * scale);
+    return n;
+}
 
-        uint8_t *cropped;
-        cropped = crop(buffer, srcW, srcH, sub_x, sub_y, sub_w, sub_h);
+void fill_screen_direct(uint8_t *screen, gd_GIF *gif, int x, int y, int w,
+                        int h)
+{
+    int stride = scr->width * 4;
 
-        scaled = scale_to_screen(scaled, cropped, sub_w, 0, 0, sub_w, sub_h, i);
-        free(cropped);
+#ifdef HAVE_LIBXINERAMA
+    for (int i = 0; i < num_xinerama_screens; i++) {
+        render_frame(gif, screen_origin(screen, i), stride, x, y, w, h);
     }
+#else
+    render_frame(gif, screen, stride, x, y, w, h);
+#endif /* HAVE_LIBXINERAMA */
+}
 
-    _generate_pmap(pmap, scaled, 0, 0, scr->width, scr->height);
+/**
+ * Returns 1 if a w x h frame is displayed unscaled on every screen, so that it
+ * can be rendered straight into the pixmap's buffer.
+ */
 
-    free(scaled);
+int frame_fits_screens(int w, int h)
+{
+    if (display_mode == DISPLAY_MODE_EXTEND || xrender_mode)
+        return 0;
+#ifdef HAVE_LIBXINERAMA
+    for (int i = 0; i < num_xinerama_screens; i++) {
+        if (xinerama_screens[i].width != w || xinerama_screens[i].height != h)
+            return 0;
+    }
+    return 1;
+#else
+    return scr->width == w && scr->height == h;
+#endif /* HAVE_LIBXINERAMA */
+}
 
-    return pmap;
+#ifdef HAVE_LIBXEXT
+static int shm_error_handler(Display *d, XErrorEvent *e)
+{
+    shm_error = 1;
+    return 0;
+}
+
+static void free_shm_segment(ShmSegment *seg)
+{
+    XShmDetach(disp, &seg->info);
+    shmdt(seg->info.shmaddr);
+    memset(seg, 0, sizeof(ShmSegment));
+}
+
+/**
+ * Creates a shared memory segment of size bytes in seg, and attaches the
+ * server to it. Attaching fails on remote displays, which X reports
+ * asynchronously, so this syncs to catch the error.
+ */
+
+static int alloc_shm_segment(ShmSegment *seg, size_t size)
+{
+    seg->size = size;
+    seg->info.shmid = shmget(IPC_PRIVATE, seg->size, IPC_CREAT | 0600);
+    if (seg->info.shmid < 0) {
+        memset(seg, 0, sizeof(ShmSegment));
+        return -1;
+    }
+    seg->info.shmaddr = shmat(seg->info.shmid, NULL, 0);
+    seg->info.readOnly = True;
+
+    XErrorHandler handler = XSetErrorHandler(shm_error_handler);
+    shm_error = 0;
+    Status attached = XShmAttach(disp, &seg->info);
+    XSync(disp, False);
+    XSetErrorHandler(handler);
+    // The segment goes away once both sides have detached from it.
+    shmctl(seg->info.shmid, IPC_RMID, NULL);
+
+    if (seg->info.shmaddr == (char *)-1 || !attached || shm_error) {
+        if (seg->info.shmaddr != (char *)-1)
+            shmdt(seg->info.shmaddr);
+        memset(seg, 0, sizeof(ShmSegment));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Uploads a buffer to (x, y) of a pixmap through the next segment of the pool.
+ * Returns -1 if shared memory cannot be used, after which it is not tried
+ * again.
+ */
+
+static int shm_put_image(Pixmap pmap, GC gc, uint8_t *buffer, int x, int y,
+                         int w, int h)
+{
+    // Only the header is created, it points into the segment.
+    XImage *img = XShmCreateImage(disp, vis, depth, ZPixmap, NULL, NULL, w, h);
+    if (!img)
+        return -1;
+    size_t size = (size_t)img->bytes_per_line * h;
+
+    pthread_mutex_lock(&shm_lock);
+    ShmSegment *seg = &shm_pool[shm_next];
+    shm_next = (shm_next + 1) % SHM_POOL_SIZE;
+
+    if (seg->pending) {
+        XSync(disp, False);
+        for (int i = 0; i < SHM_POOL_SIZE; i++)
+            shm_pool[i].pending = 0;
+    }
+
+    if (seg->size && seg->size < size)
+        free_shm_segment(seg);
+    if (!seg->size) {
+        size_t grown = SHM_MIN_BYTES;
+        while (grown < size)
+            grown *= 2;
+        if (alloc_shm_segment(seg, grown)) {
+            shm_available = 0;
+            pthread_mutex_unlock(&shm_lock);
+            XFree(img);
+            return -1;
+        }
+    }
+
+    img->data = seg->info.shmaddr;
+    img->obdata = (char *)&seg->info;
+    for (int row = 0; row < h; row++)
+        memcpy(&img->data[row * img->bytes_per_line], &buffer[row * w * 4],
+               w * 4);
+    XShmPutImage(disp, pmap, gc, img, 0, 0, x, y, w, h, False);
+    seg->pending = 1;
+
+    pthread_mutex_unlock(&shm_lock);
+    // The segment is not the header's to free.
+    XFree(img);
+    return 0;
 }
+#endif /* HAVE_LIBXEXT */
+
+/**
+ * Uploads a buffer of 32-bit pixels to (x, y) of a pixmap. Uses MIT-SHM when
+ * the server supports it, and XPutImage() otherwise.
+ */
 
 Pixmap _generate_pmap(Pixmap pmap, uint8_t *buffer, int x, int y, int w, int h)
 {
-    GC gc = XCreateGC(disp, root, 0, 0);
-    XImage *img = XCreateImage(disp, CopyFromParent, depth, ZPixmap, 0,
-                               (char *)buffer, w, h, 32, 0);
-    XPutImage(disp, pmap, gc, img, 0, 0, x, y, w, h);
-    XFreeGC(disp, gc);
+    uploaded += (size_t)w * h * 4;
+#ifdef HAVE_LIBXEXT
+    if (shm_available && (size_t)w * h * 4 >= SHM_MIN_BYTES &&
+        !shm_put_image(pmap, upload_gc, buffer, x, y, w, h))
+        return pmap;
+#endif /* HAVE_LIBXEXT */
+    pthread_mutex_lock(&put_lock);
+    if (put_img && (put_img->width != w || put_img->height != h)) {
+        XDestroyImage(put_img);
+        put_img = NULL;
+    }
+    if (!put_img)
+        put_img = XCreateImage(disp, CopyFromParent, depth, ZPixmap, 0, NULL,
+                               w, h, 32, 0);
+    put_img->data = (char *)buffer;
+    int rows = MAX(put_chunk_bytes / (w * 4), 1);
+    for (int row = 0; row < h; row += rows)
+        XPutImage(disp, pmap, upload_gc, put_img, 0, row, x, y + row, w,
+                  MIN(rows, h - row));
+    // The buffer belongs to the caller, the header must not free it.
+    put_img->data = NULL;
+    pthread_mutex_unlock(&put_lock);
 
     return pmap;
 }
 
+static int pixmap_slot(Pixmap pmap)
+{
+    return (uint32_t)(pmap * 2654435761u) & (pixmap_set_size - 1);
+}
+
+static void pixmap_set_insert(Pixmap pmap)
+{
+    if (2 * (pixmap_set_count + 1) > pixmap_set_size) {
+        Pixmap *old = pixmap_set;
+        int old_size = pixmap_set_size;
+        pixmap_set_size = old_size ? old_size * 2 : 64;
+        pixmap_set = (Pixmap *)calloc(pixmap_set_size, sizeof(Pixmap));
+        pixmap_set_count = 0;
+        for (int i = 0; i < old_size; i++)
+            if (old[i] != None)
+                pixmap_set_insert(old[i]);
+        free(old);
+    }
+
+    int i = pixmap_slot(pmap);
+    while (pixmap_set[i] != None)
+        i = (i + 1) & (pixmap_set_size - 1);
+    pixmap_set[i] = pmap;
+    pixmap_set_count++;
+}
+
+static int pixmap_set_find(Pixmap pmap)
+{
+    if (!pixmap_set_size)
+        return -1;
+    for (int i = pixmap_slot(pmap); pixmap_set[i] != None;
+         i = (i + 1) & (pixmap_set_size - 1))
+        if (pixmap_set[i] == pmap)
+            return i;
+    return -1;
+}
+
+static void pixmap_set_remove(Pixmap pmap)
+{
+    int i = pixmap_set_find(pmap);
+    if (i < 0)
+        return;
+
+    // Move later entries of the run back into the hole, wherever their own
+    // slot allows it, so that lookups never stop short of them.
+    int mask = pixmap_set_size - 1;
+    for (int j = (i + 1) & mask; pixmap_set[j] != None; j = (j + 1) & mask) {
+        int k = pixmap_slot(pixmap_set[j]);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            pixmap_set[i] = pixmap_set[j];
+            i = j;
+        }
+    }
+    pixmap_set[i] = None;
+    pixmap_set_count--;
+}
+
+/**
+ * Returns whether this process created the pixmap.
+ */
+
+static int pixmap_is_ours(Pixmap pmap)
+{
+    pthread_mutex_lock(&pixmap_set_lock);
+    int found = pixmap_set_find(pmap) >= 0;
+    pthread_mutex_unlock(&pixmap_set_lock);
+    return found;
+}
+
+/**
+ * Creates a w x h pixmap for the root window, and remembers it as ours.
+ */
+
+Pixmap new_pixmap(int w, int h)
+{
+    Pixmap pmap = XCreatePixmap(disp, root, w, h, depth);
+    pthread_mutex_lock(&pixmap_set_lock);
+    pixmap_set_insert(pmap);
+    pthread_mutex_unlock(&pixmap_set_lock);
+    return pmap;
+}
+
+size_t uploaded_bytes(void)
+{
+    return uploaded;
+}
+
 void clear_pmap(Pixmap pmap)
 {
+    // Its XID may be handed out again.
+    if (pmap == background)
+        background = None;
+    pthread_mutex_lock(&pixmap_set_lock);
+    pixmap_set_remove(pmap);
+    pthread_mutex_unlock(&pixmap_set_lock);
     XFreePixmap(disp, pmap);
 }
 
@@ -189,39 +797,66 @@ Pixmap get_pixmap(Frame *frame)
         } else {
             return -1;
         }
+    case INDEXED_FRAME:
+        if (frame->imap.active) {
+            return frame->imap.pmap;
+        } else {
+            return -1;
+        }
     default:
         return frame->pmap;
     }
 }
 
-int set_background(Frame *frame)
-{
-    return _set_background(frame, NULL);
-}
+/**
+ * Draws frame i of the table to the background.
+ */
 
-int _set_background(Frame *frame, Frame *frame_last)
+int set_background(FrameTable *t, int i)
 {
     int ret;
     Pixmap pmap;
+    uint8_t *buffer;
+    Frame *frame = &t->frames[i];
 
     switch (frame->type) {
     case PIXMAP_FRAME:
-        ret = draw_pmap_to_background(frame, frame_last, frame->pmap);
+        pmap = frame->pmap;
         break;
     case BUFFER_FRAME:
-        pmap = generate_pmap(frame->bmap.buf, frame->bmap.w, frame->bmap.h);
-        ret = draw_pmap_to_background(frame, frame_last, pmap);
+        buffer = expand_bmap(&frame->bmap);
+        pmap = generate_pmap(buffer, frame->bmap.w, frame->bmap.h);
+        if (buffer != frame->bmap.buf)
+            free(buffer);
         frame->bmap.active = 1;
         frame->bmap.pmap = pmap;
         break;
+    case INDEXED_FRAME:
+        buffer = expand_imap(&frame->imap);
+        pmap = generate_pmap(buffer, frame->imap.w, frame->imap.h);
+        free(buffer);
+        frame->imap.active = 1;
+        frame->imap.pmap = pmap;
+        break;
+    case PATCH_FRAME:
+        pmap = None;
+        break;
     default:
-        ret = draw_pmap_to_background(frame, frame_last, frame->pmap);
+        pmap = frame->pmap;
         break;
     }
 
-    Frame *p = frame->prev;
-    if (!p)
-        return ret;
+    if (frame->type == PATCH_FRAME) {
+        ret = draw_patch_to_background(t, frame->pmap);
+    } else {
+#ifdef HAVE_LIBXRENDER
+        if (xrender_mode)
+            pmap = xrender_scale_to_screen(pmap, t->w, t->h);
+#endif /* HAVE_LIBXRENDER */
+        ret = draw_pmap_to_background(pmap);
+    }
+
+    Frame *p = &t->frames[PREV_FRAME(t, i)];
 
     switch (p->type) {
     case PIXMAP_FRAME:
@@ -229,7 +864,13 @@ int _set_background(Frame *frame, Frame *frame_last)
     case BUFFER_FRAME:
         if (p->bmap.active && frame != p) {
             p->bmap.active = 0;
-            XFreePixmap(disp, p->bmap.pmap);
+            clear_pmap(p->bmap.pmap);
+        }
+        break;
+    case INDEXED_FRAME:
+        if (p->imap.active && frame != p) {
+            p->imap.active = 0;
+            clear_pmap(p->imap.pmap);
         }
         break;
     default:
@@ -239,63 +880,34 @@ int _set_background(Frame *frame, Frame *frame_last)
     return ret;
 }
 
-int draw_pmap_to_background(Frame *frame, Frame *prev, Pixmap pmap)
-{
-    Frame *c = frame;
+/**
+ * Kills the client that owns the wallpaper, unless it is us, so that its
+ * pixmap is freed rather than kept around by RetainPermanent.
+ */
 
-    Atom prop_root, prop_esetroot, type;
+static void kill_root_owner(void)
+{
+    Atom type;
     int format;
     unsigned long length, after;
     unsigned char *data_root = NULL, *data_esetroot = NULL;
 
-    prop_root = XInternAtom(disp, "_XROOTPMAP_ID", True);
-    prop_esetroot = XInternAtom(disp, "ESETROOT_PMAP_ID", True);
-
-    if (prop_root != None && prop_esetroot != None) {
-        XGetWindowProperty(disp, root, prop_root, 0L, 1L, False,
+    XGetWindowProperty(disp, root, prop_root, 0L, 1L, False, AnyPropertyType,
+                       &type, &format, &length, &after, &data_root);
+    if (type == XA_PIXMAP) {
+        XGetWindowProperty(disp, root, prop_esetroot, 0L, 1L, False,
                            AnyPropertyType, &type, &format, &length, &after,
-                           &data_root);
-        if (type == XA_PIXMAP) {
-            XGetWindowProperty(disp, root, prop_esetroot, 0L, 1L, False,
-                               AnyPropertyType, &type, &format, &length, &after,
-                               &data_esetroot);
-            if (data_root && data_esetroot) {
-                if (type == XA_PIXMAP &&
-                    *((Pixmap *)data_root) == *((Pixmap *)data_esetroot)) {
-                    // Looks like someone owns the root window. Let's see who it
-                    // is! printf("Checking to see who owns the root window...
-                    // \n");
-
-                    Pixmap target_pmap = *((Pixmap *)data_root);
-                    int kill = 1;
-                    while (1) {
-                        if (target_pmap == get_pixmap(c)) {
-                            kill = 0;
-                            break;
-                        }
-                        c = c->next;
-                        if (c == NULL || c == frame) {
-                            break;
-                        }
-                    }
-
-                    if (prev != NULL) {
-                        c = prev;
-                        while (1) {
-                            if (target_pmap == get_pixmap(c)) {
-                                kill = 0;
-                                break;
-                            }
-                            c = c->next;
-                            if (c == NULL || c == frame) {
-                                break;
-                            }
-                        }
-                    }
-
-                    if (kill) {
-                        XKillClient(disp, target_pmap);
-                    }
+                           &data_esetroot);
+        if (data_root && data_esetroot) {
+            if (type == XA_PIXMAP &&
+                *((Pixmap *)data_root) == *((Pixmap *)data_esetroot)) {
+                // Looks like someone owns the root window. Let's see who it
+                // is! printf("Checking to see who owns the root window...
+                // \n");
+
+                Pixmap target_pmap = *((Pixmap *)data_root);
+                if (!pixmap_is_ours(target_pmap)) {
+                    XKillClient(disp, target_pmap);
                 }
             }
         }
@@ -305,23 +917,72 @@ int draw_pmap_to_background(Frame *frame, Frame *prev, Pixmap pmap)
         XFree(data_root);
     if (data_esetroot)
         XFree(data_esetroot);
+}
 
-    /* This will locate the property, creating it if it doesn't exist */
-    prop_root = XInternAtom(disp, "_XROOTPMAP_ID", False);
-    prop_esetroot = XInternAtom(disp, "ESETROOT_PMAP_ID", False);
+/**
+ * Reads the changes to the root window's properties since the last call, and
+ * notes whether someone else set the wallpaper. It runs every frame, drawn or
+ * not, so that the events do not pile up in the queue.
+ */
 
+void read_root_events(void)
+{
+    // Our own changes to the property come back as events too. Only the ones
+    // beyond those mean that someone else set the wallpaper.
+    XEvent ev;
+    while (XCheckTypedWindowEvent(disp, root, PropertyNotify, &ev)) {
+        if (ev.xproperty.atom != prop_root)
+            continue;
+        if (own_root_changes > 0)
+            own_root_changes--;
+        else
+            root_changed = 1;
+    }
+}
+
+/**
+ * If someone else set the wallpaper, kills their client and returns 1: ours
+ * has to be set again rather than just redrawn.
+ */
+
+int check_root_owner(void)
+{
+    read_root_events();
+    if (!root_changed)
+        return 0;
+
+    kill_root_owner();
+    root_changed = 0;
+    background = None;
+
+    return 1;
+}
+
+int draw_pmap_to_background(Pixmap pmap)
+{
     if (prop_root == None || prop_esetroot == None) {
         fprintf(stderr, "error: Creation of display pixmap properties failed.");
         return 1;
     }
 
+    check_root_owner();
+
+    background = pmap;
     XChangeProperty(disp, root, prop_root, XA_PIXMAP, 32, PropModeReplace,
                     (unsigned char *)&pmap, 1);
     XChangeProperty(disp, root, prop_esetroot, XA_PIXMAP, 32, PropModeReplace,
                     (unsigned char *)&pmap, 1);
+    own_root_changes++;
 
     XSetWindowBackgroundPixmap(disp, root, pmap);
-    XClearWindow(disp, root);
+#ifdef HAVE_LIBXPRESENT
+    // The background still covers exposures, the frame itself is put on
+    // screen at the next vertical blank.
+    if (present_mode)
+        present_pmap(pmap);
+    else
+#endif /* HAVE_LIBXPRESENT */
+        XClearWindow(disp, root);
     XFlush(disp);
 
     return 0;
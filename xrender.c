@@ -0,0 +1,122 @@
+#include "gifpaper.h"
+
+/**
+ * Server-side scaling. Frames are kept as pixmaps of the gif's size, and the
+ * X server scales each one onto the screens with XRender when it is shown, so
+ * neither the client nor the server holds a screen-sized copy of every frame.
+ * Frames are scaled into two screen-sized pixmaps in turn, so that the one on
+ * display is never the one being drawn.
+ */
+
+#ifdef HAVE_LIBXRENDER
+static Pixmap targets[2];
+static Picture target_pics[2];
+static int next_target = 0;
+static XRenderPictFormat *format = NULL;
+
+int init_xrender(void)
+{
+    int event, error;
+
+    if (!XRenderQueryExtension(disp, &event, &error))
+        return -1;
+    format = XRenderFindVisualFormat(disp, vis);
+    if (!format)
+        return -1;
+
+    for (int i = 0; i < 2; i++) {
+        targets[i] = new_pixmap(scr->width, scr->height);
+        target_pics[i] =
+            XRenderCreatePicture(disp, targets[i], format, 0, NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * Makes new targets of the screen's current size. The old ones are stored in
+ * old, to be freed by the caller once a new frame is on display, and their
+ * number is returned.
+ */
+
+int xrender_new_targets(Pixmap *old)
+{
+    for (int i = 0; i < 2; i++) {
+        old[i] = targets[i];
+        XRenderFreePicture(disp, target_pics[i]);
+        targets[i] = new_pixmap(scr->width, scr->height);
+        target_pics[i] =
+            XRenderCreatePicture(disp, targets[i], format, 0, NULL);
+    }
+
+    return 2;
+}
+
+static const char *filter_name(void)
+{
+    switch (scale_filter) {
+    case SCALE_FILTER_BILINEAR:
+        return FilterBilinear;
+    case SCALE_FILTER_LANCZOS:
+        return FilterBest;
+    default:
+        return FilterNearest;
+    }
+}
+
+/**
+ * Scales the (sx, sy, sw, sh) part of the source onto the (x, y, w, h) part of
+ * the destination.
+ */
+
+static void composite_rect(Picture src, double sx, double sy, double sw,
+                           double sh, Picture dst, int x, int y, int w, int h)
+{
+    XTransform xf = {{{XDoubleToFixed(sw / w), 0, XDoubleToFixed(sx)},
+                      {0, XDoubleToFixed(sh / h), XDoubleToFixed(sy)},
+                      {0, 0, XDoubleToFixed(1)}}};
+
+    XRenderSetPictureTransform(disp, src, &xf);
+    XRenderComposite(disp, PictOpSrc, src, None, dst, 0, 0, 0, 0, x, y, w, h);
+}
+
+/**
+ * Scales a w x h frame pixmap onto the screens, laid out like fill_screen()
+ * does on the client. Returns the screen-sized pixmap to display.
+ */
+
+Pixmap xrender_scale_to_screen(Pixmap pmap, int w, int h)
+{
+    int t = next_target;
+    next_target = !next_target;
+#ifdef HAVE_LIBXPRESENT
+    if (present_mode)
+        present_wait_idle(targets[t]);
+#endif /* HAVE_LIBXPRESENT */
+
+    // Edge pixels are stretched rather than blended with transparency.
+    XRenderPictureAttributes attrs;
+    attrs.repeat = RepeatPad;
+    Picture src = XRenderCreatePicture(disp, pmap, format, CPRepeat, &attrs);
+    XRenderSetPictureFilter(disp, src, filter_name(), NULL, 0);
+
+#ifdef HAVE_LIBXINERAMA
+    for (int i = 0; i < num_xinerama_screens; i++) {
+        int sx = 0, sy = 0, sw = w, sh = h;
+        if (display_mode == DISPLAY_MODE_EXTEND &&
+            !extend_source_rect(i, w, h, &sx, &sy, &sw, &sh))
+            continue;
+        composite_rect(src, sx, sy, sw, sh, target_pics[t],
+                       xinerama_screens[i].x_org, xinerama_screens[i].y_org,
+                       xinerama_screens[i].width, xinerama_screens[i].height);
+    }
+#else
+    composite_rect(src, 0, 0, w, h, target_pics[t], 0, 0, scr->width,
+                   scr->height);
+#endif /* HAVE_LIBXINERAMA */
+
+    XRenderFreePicture(disp, src);
+
+    return targets[t];
+}
+#endif /* HAVE_LIBXRENDER */